@@ -21,12 +21,23 @@
 #include "help.hpp"
 #include "ifile.hpp"
 #include "less.hpp"
+#include "lz.hpp"
 #include "option.hpp"
 #include "os.hpp"
 #include "output.hpp"
 #include "prompt.hpp"
 #include "screen.hpp"
 #include "signal.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 // For debugging only
 #include <iostream>
@@ -39,98 +50,239 @@ extern dev_t curr_dev;
 extern ino_t curr_ino;
 #endif
 
+#if HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <poll.h>
+#if HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+extern int tty;
+
 namespace ch {
 
 typedef position_t blocknum_t;
 
 /*
  * Pool of buffers holding the most recently used blocks of the input file.
- * The buffer pool is kept as a doubly-linked circular list,
- * in order from most- to least-recently used.
- * The circular list is anchored by the file state "thisfile".
+ * Buffers are numbered by slot.  The buffer pool is kept in order from
+ * most- to least-recently used by a doubly-linked list of slot numbers,
+ * held apart from the buffers themselves; -1 ends the list.
+ */
+struct lrulink {
+  int next, prev;
+};
+
+/*
+ * An entry of a block index, giving the slot of the buffer holding
+ * a block.  Unused entries have a block of -1.
  */
-struct bufnode {
-  struct bufnode *next, *prev;
-  struct bufnode *hnext, *hprev;
+struct bindex {
+  blocknum_t block;
+  int        slot;
 };
 
-const int LBUFSIZE = 8192;
+/*
+ * Block sizes.  Each file has its own block size, chosen when its
+ * filestate is created (see ch_blocksize).  Block sizes are always
+ * a power of two between LBUFSIZE and MAX_BLKSIZE.
+ */
+const unsigned int LBUFSIZE     = 8192;            /* Smallest (and default) block size */
+const unsigned int PIPE_BLKSIZE = 64 * 1024;       /* Default block size for pipes */
+const unsigned int AUTO_BLKSIZE = 1024 * 1024;     /* Largest block size chosen automatically */
+const unsigned int MAX_BLKSIZE  = 8 * 1024 * 1024; /* Largest block size allowed */
+const position_t   AUTO_NBLOCKS = 1024;            /* Blocks per file we aim for */
+const int          MIN_BIGBUFS  = 4;               /* Min buffers if blocks > LBUFSIZE */
+const int          FILL_BLOCKS  = 16;              /* Most blocks filled by one read */
+const size_t       LOG_PENDING  = 8 * 1024 * 1024; /* Most data waiting for the log file */
 
+/*
+ * The data of a buffer immediately follows the buf structure,
+ * in the same allocation.
+ */
 struct buf {
-  struct bufnode node;
   blocknum_t     block;
   unsigned int   datasize;
-  unsigned char  data[LBUFSIZE];
+  unsigned char* data;
+  struct buf*    nextfree; /* Next buffer on the free list */
 };
-#define bufnode_buf(bn) ((struct buf*)(bn))
+
 /*
- * The file state is maintained in a filestate structure.
- * A pointer to the filestate is kept in the ifile structure.
+ * Buffers are carved from slabs (see "Slabs" below).  A slab starts
+ * with this header, then the buf structures, then the data of each
+ * buffer, page aligned.
  */
-const int BUFHASH_SIZE = 1024;
-
-struct filestate {
-  struct bufnode buflist;
-  struct bufnode hashtbl[BUFHASH_SIZE];
-  int            file;
-  int            flags;
-  position_t     fpos;
-  int            nbufs;
-  blocknum_t     block;
-  unsigned int   offset;
-  position_t     fsize;
+struct slab {
+  struct slab* next;
+  size_t       size; /* Bytes allocated */
+  bool         huge; /* Backed by huge pages? */
 };
 
-// thisfile->buflist.next is the HEAD of the chain
-// thisfile->buflist.prev is the TAIL of the chain
-#define END_OF_CHAIN (&thisfile->buflist)
-#define END_OF_HCHAIN(h) (&thisfile->hashtbl[h])
-#define BUFHASH(blk) ((blk) & (BUFHASH_SIZE - 1))
-
 /*
- * Macros to manipulate the list of buffers in thisfile->buflist.
+ * A blockset holds the buffers of one file: the buffers by slot, the
+ * LRU list, and an index to find a buffer by block number.
+ * The index is an open-addressing hash table with linear probing,
+ * at most half full; it doubles in size as buffers are added, so
+ * finding a block usually touches a single cache line.
+ *
+ * Blocksets of regular files are kept in the block cache, keyed by
+ * the file's device and inode, and outlive the filestates using them;
+ * see "The block cache" below.  Other blocksets (pipes, the help file)
+ * belong to a single filestate.
  */
-#define FOR_BUFS(bn) \
-  for ((bn) = thisfile->buflist.next; (bn) != END_OF_CHAIN; (bn) = (bn)->next)
+const int MIN_INDEX = 64;
+
+struct blockset {
+  struct buf**     bufs;   /* Buffers, by slot */
+  struct lrulink*  lru;    /* LRU list links, by slot */
+  int              nslots; /* Size of bufs and lru */
+  int              head;   /* Most recently used slot, or -1 */
+  int              tail;   /* Least recently used slot, or -1 */
+  struct bindex*   index;  /* Block index */
+  int              nindex; /* Size of the index (a power of two) */
+  int              ibits;  /* log2 of nindex */
+  unsigned int     blksize;
+  int              nbufs;
+  struct slab*     slabs;    /* Slabs holding the buffers */
+  struct buf*      freebufs; /* Buffers in slabs not in use */
+  int              slabbufs; /* Buffers to put in the next slab */
+  int              users;  /* Number of filestates using this blockset */
+  bool             cached; /* Is it in the block cache? */
+  dev_t            dev;    /* Identity of the file (if cached) */
+  ino_t            ino;
+  position_t       size;
+  struct timespec  mtime;
+  struct blockset* next; /* Block cache list, most recently used first */
+  struct blockset* prev;
+  bool             spill;     /* Keep evicted blocks, in a spill file or compressed? */
+  bool             compress;  /* Compress them in memory instead of spilling */
+  int              spillfd;   /* The spill file, or -1 if not open yet */
+  unsigned int*    spillsize; /* Size of each spilled block; 0 if not spilled */
+  struct zblock*   zblocks;   /* Compressed blocks (if compress) */
+  blocknum_t       nspill;    /* Number of entries in spillsize and zblocks */
+  position_t       spillend;  /* End of the last spilled data */
+};
 
-#define BUF_RM(bn)               \
-  (bn)->next->prev = (bn)->prev; \
-  (bn)->prev->next = (bn)->next;
+/*
+ * A block kept compressed in memory (--compress).
+ */
+struct zblock {
+  unsigned char* data; /* Compressed data, or nullptr */
+  unsigned int   size; /* Size of the data */
+  bool           raw;  /* The block didn't compress, and is stored as is */
+};
 
-#define BUF_INS_HEAD(bn)                                 \
-  (bn)->next                   = thisfile->buflist.next; \
-  (bn)->prev                   = END_OF_CHAIN;           \
-  thisfile->buflist.next->prev = (bn);                   \
-  thisfile->buflist.next       = (bn);
+/*
+ * The file state is maintained in a filestate structure.
+ * A pointer to the filestate is kept in the ifile structure.
+ *
+ * If the file is a regular, seekable file and the --mmap option is set,
+ * the whole file is mapped into memory (mapaddr/mapsize) and ch_get
+ * reads straight from the mapping.  The buffer pool is then only used
+ * for data beyond the end of the mapping (e.g. if the file has grown).
+ * If the file shrinks under the mapping (e.g. "> file"), reading past its
+ * new end raises SIGBUS; map_bus puts zero pages in place of the lost
+ * part, and the next read looks at the size again (map_check).
+ */
+/*
+ * With --follow-name, when a file being followed is replaced by a new
+ * file of the same name (e.g. rotated by logrotate), the new file is
+ * chained on after the old one, which is kept open.
+ * Its data starts at position start.
+ */
+struct chainlink {
+  int        file;
+  position_t start;
+};
 
-#define BUF_INS_TAIL(bn)                                 \
-  (bn)->next                   = END_OF_CHAIN;           \
-  (bn)->prev                   = thisfile->buflist.prev; \
-  thisfile->buflist.prev->next = (bn);                   \
-  thisfile->buflist.prev       = (bn);
+struct filestate {
+  struct blockset* bs;
+  int              maxbufs;
+  int              file;
+  int              flags;
+  position_t       fpos;
+  blocknum_t       block;
+  unsigned int     offset;
+  position_t       fsize;
+  unsigned char*   mapaddr;
+  position_t       mapsize;
+  int              dfile; /* O_DIRECT descriptor (--direct-io); -1 if not open */
+  int              watch; /* inotify watch for follow mode; -1 if none, -2 if nothing to watch */
+  int              dwatch; /* inotify watch on the file's directory (--follow-name) */
+  struct chainlink* chain; /* Earlier files of the same name (--follow-name) */
+  int              nchain;
+  position_t       base; /* Position of the first byte of file */
+};
 
 /*
- * Macros to manipulate the list of buffers in thisfile->hashtbl[n].
+ * Loop over the buffer slots of the current file,
+ * from most- to least-recently used.
  */
-#define FOR_BUFS_IN_CHAIN(h, bn)                                    \
-  for ((bn) = thisfile->hashtbl[h].hnext; (bn) != END_OF_HCHAIN(h); \
-       (bn) = (bn)->hnext)
-
-#define BUF_HASH_RM(bn)             \
-  (bn)->hnext->hprev = (bn)->hprev; \
-  (bn)->hprev->hnext = (bn)->hnext;
+#define FOR_BUFS(slot) \
+  for ((slot) = thisfile->bs->head; (slot) >= 0; (slot) = thisfile->bs->lru[slot].next)
 
-#define BUF_HASH_INS(bn, h)                                       \
-  (bn)->hnext                       = thisfile->hashtbl[h].hnext; \
-  (bn)->hprev                       = END_OF_HCHAIN(h);           \
-  thisfile->hashtbl[h].hnext->hprev = (bn);                       \
-  thisfile->hashtbl[h].hnext        = (bn);
+/*
+ * The most recently used buffer of the current file, or nullptr.
+ */
+#define HEAD_BUF() \
+  ((thisfile->bs->head >= 0) ? thisfile->bs->bufs[thisfile->bs->head] : nullptr)
 
 namespace {
   static struct filestate* thisfile;
   static int               ch_ungotchar = -1;
-  static int               maxbufs      = -1;
+  static position_t        maxbufspace  = -1; /* In bytes; -1 means no limit */
   static int               ch_addbuf();
+  static struct buf*       buf_alloc(struct blockset* bs, int maxb);
+  static void              buf_free(struct blockset* bs, struct buf* bp);
+  static void              slab_freeall(struct blockset* bs);
+  static size_t            page_size();
+  static int               index_find(struct blockset* bs, blocknum_t block);
+  static void              index_insert(struct blockset* bs, blocknum_t block, int slot);
+  static void              index_remove(struct blockset* bs, blocknum_t block);
+  static void              index_clear(struct blockset* bs);
+  static void              lru_unlink(struct blockset* bs, int slot);
+  static void              lru_push_head(struct blockset* bs, int slot);
+  static void              lru_push_tail(struct blockset* bs, int slot);
+  static void              cache_trim(unsigned int need);
+  static void              cache_unlink(struct blockset* bs);
+  static void              cache_stamp(struct blockset* bs, int f);
+  static position_t        cache_used = 0; /* Bytes in cached blocksets' buffers */
+  static bool              spilled(blocknum_t block);
+  static void              spill_put(struct buf* bp);
+  static bool              spill_get(struct buf* bp);
+  static int               spill_read(blocknum_t block, unsigned char* data);
+  static void              zfree(struct blockset* bs, blocknum_t block);
+  static bool              ch_remap(position_t pos);
+  static bool              ra_take(struct buf* bp);
+  static void              ra_schedule();
+  static void              ra_cancel();
+  static void              log_put(const unsigned char* data, size_t len);
+  static void              log_flush();
+  static int               ch_fill(struct buf* bp, int slot, position_t pos, bool sequential);
+  static int               ch_drain(position_t pos);
+  static void              follow_wait();
+  static bool              follow_key = false; /* A key was pressed in follow_wait */
+  static bool              follow_name();
+  static void              follow_stop();
+  static int               chain_source(position_t pos, position_t* offp, position_t* endp);
+  static position_t        chain_size();
+  static void              chain_close();
+  static void              fadv_start();
+  static void              fadv_ahead(position_t pos);
+  static void              fadv_drop(blocknum_t block);
+  static void              fadv_close();
+  static int               direct_file(struct iovec* iov, int iovcnt, position_t pos);
+  static void              direct_fail();
+  static int               ra_dir = 1;
+#if HAVE_MMAP
+  static bool ch_map();
+  static void ch_unmap();
+  static void map_check();
+  static volatile sig_atomic_t map_fault = 0; /* map_bus has replaced part of the mapping */
+#endif
 }
 
 namespace {
@@ -158,79 +310,36 @@ std::string ptr_to_string(const void* ptr)
   return ret;
 }
 
-// TODO: remove debug only routines
-std::string to_string(bufnode* node);
-
-// TODO: remove debug only routines
-std::string hashtbl_to_string(bufnode* bn)
-{
-  std::string val = "";
-  val += " HASHTBL SKIPPED";
-  // for (int i = 0; i < BUFHASH_SIZE; i++) {
-  //     val += "hastbl[" + std::to_string(i) + "]: \n";
-  //     val += to_string((bufnode *)&bn[i]);
-  // }
-  return val;
-};
-
 // TODO: remove debug only routines
 std::string to_string(buf* bufPtr)
 {
   std::string ret = "   buf []" + ptr_to_string(bufPtr);
-  ret += "\n   node: -> ";
-  ret += ptr_to_string(&bufPtr->node);
   ret += "\n   block: ";
   ret += std::to_string(static_cast<int>(bufPtr->block));
   ret += "\n   datasize: ";
   ret += std::to_string(static_cast<int>(bufPtr->datasize));
   ret += "\n   data[]: ";
-  ret += reinterpret_cast<char*>(bufPtr->data);
+  ret.append(reinterpret_cast<char*>(bufPtr->data), bufPtr->datasize);
   ret += "\n";
   return ret;
 };
 
-// TODO: remove debug only routines
-std::string to_string(bufnode* node)
-{
-  std::string ret = "";
-  ret += " [node address = " + ptr_to_string(node) + "]\n";
-  ret += " next:";
-  ret += ptr_to_string(static_cast<void*>(node->next));
-  ret += "\n";
-  if (node != node->next && node->next != nullptr)
-    ret += to_string((buf*)node->next) + "\n";
-  ret += " prev: ";
-  ret += ptr_to_string(static_cast<void*>(node->prev));
-  ret += "\n";
-  if (node != node->prev && node->prev != nullptr)
-    ret += to_string((buf*)node->prev) + "\n";
-  ret += " hnext: ";
-  ret += ptr_to_string(static_cast<void*>(node->hnext));
-  ret += "\n";
-  if (node != node->hnext && node->hnext != nullptr)
-    ret += to_string((buf*)node->hnext) + "\n";
-  ret += " hprev: ";
-  ret += ptr_to_string(static_cast<void*>(node->hprev));
-  ret += "\n";
-  if (node != node->hprev && node->hprev != nullptr)
-    ret += to_string((buf*)node->hprev) + "\n";
-  return ret;
-}
-
 // TODO: remove debug only routines
 std::string to_string(filestate* fs)
 {
   std::string ret = "";
-  ret += "buflist:\n";
-  ret += to_string(&fs->buflist);
-  ret += hashtbl_to_string(fs->hashtbl);
+  ret += "head: " + std::to_string(fs->bs->head);
+  ret += "\ntail: " + std::to_string(fs->bs->tail);
+  ret += "\nnindex: " + std::to_string(fs->bs->nindex);
   ret += "\nfile: " + std::to_string(fs->file);
   ret += "\nflags: " + std::to_string(fs->flags);
   ret += "\nfpos: " + std::to_string(fs->fpos);
-  ret += "\nnbufs: " + std::to_string(fs->nbufs);
+  ret += "\nnbufs: " + std::to_string(fs->bs->nbufs);
+  ret += "\nblksize: " + std::to_string(fs->bs->blksize);
   ret += "\nblock: " + std::to_string(fs->block);
   ret += "\noffset: " + std::to_string(fs->offset);
   ret += "\nfsize: " + std::to_string(fs->fsize);
+  ret += "\nmapsize: " + std::to_string(fs->mapsize);
   ret += "\n";
   return ret;
 };
@@ -240,33 +349,45 @@ std::string to_string(filestate* fs)
  */
 int ch_get()
 {
-  struct buf*     bp;
-  struct bufnode* bn;
-  int             n;
-  bool            slept = false;
-  int             h;
-  position_t      pos;
-  position_t      len;
+  struct buf* bp;
+  int         slot;
+  int         n;
+  bool        slept = false;
+  bool        sequential;
+  position_t  pos;
+  position_t  len;
 
   if (thisfile == nullptr) {
     chDebug("return EOI");
     return (EOI);
   }
 
+#if HAVE_MMAP
+  /*
+   * If the file is memory-mapped, the data is right there.
+   */
+  if (map_fault)
+    map_check();
+  if (thisfile->mapaddr != nullptr) {
+    pos = tell();
+    if (pos < thisfile->mapsize || ch_remap(pos))
+      return thisfile->mapaddr[pos];
+  }
+#endif
+
   chDebug("----------------------------------");
-  chDebug("ch_get - buff count = " + std::to_string(thisfile->nbufs));
+  chDebug("ch_get - buff count = " + std::to_string(thisfile->bs->nbufs));
   chDebug("block = " + std::to_string(thisfile->block) + " offset = " + std::to_string(thisfile->offset));
 
   /*
    * Quick check for the common case where
    * the desired char is in the head buffer.
    */
-  if (thisfile->buflist.next != END_OF_CHAIN) {
-    bp = bufnode_buf(thisfile->buflist.next);
+  if ((bp = HEAD_BUF()) != nullptr) {
     if (thisfile->block == bp->block && thisfile->offset < bp->datasize) {
       char        c    = static_cast<char>(bp->data[thisfile->offset]);
       std::string cstr = "'";
-      cstr += std::string(&c);
+      cstr += std::string(1, c);
       cstr += "'";
       cstr += std::to_string(c);
       chDebug("return data[offset] = " + cstr);
@@ -277,24 +398,18 @@ int ch_get()
   /*
    * Look for a buffer holding the desired block.
    */
-  h = BUFHASH(thisfile->block);
   chDebug("thisfile->block = " + std::to_string(thisfile->block));
-  chDebug("hashchain h = " + std::to_string(h));
-  FOR_BUFS_IN_CHAIN(h, bn)
-  {
-    chDebug("Searching hashchain h=" + std::to_string(h));
-    bp = bufnode_buf(bn);
-    if (bp->block == thisfile->block) {
-      if (thisfile->offset >= bp->datasize)
-        /*
-         * Need more data in this buffer.
-         */
-        break;
+  slot = index_find(thisfile->bs, thisfile->block);
+  if (slot >= 0) {
+    bp = thisfile->bs->bufs[slot];
+    if (thisfile->offset < bp->datasize) {
       chDebug("jump to found");
       goto found;
     }
-  }
-  if (bn == END_OF_HCHAIN(h)) {
+    /*
+     * Need more data in this buffer.
+     */
+  } else {
     /*
      * Block is not in a buffer.
      * Take the least recently used buffer
@@ -302,55 +417,73 @@ int ch_get()
      * If the LRU buffer has data in it,
      * then maybe allocate a new buffer.
      */
-    chDebug("bn == END_OF_CHAIN");
+    chDebug("block not buffered");
 
-    if (thisfile->buflist.prev == END_OF_CHAIN || bufnode_buf(thisfile->buflist.prev)->block != -1) {
+    if (thisfile->bs->tail < 0 || thisfile->bs->bufs[thisfile->bs->tail]->block != -1) {
       /*
        * There is no empty buffer to use.
        * Allocate a new buffer if:
        * 1. We can't seek on this file and -b is not in effect; or
        * 2. We haven't allocated the max buffers for this file yet.
        */
-      if ((less::Globals::autobuf && !(thisfile->flags & CH_CANSEEK)) || (maxbufs < 0 || thisfile->nbufs < maxbufs))
+      if ((less::Globals::autobuf && !(thisfile->flags & CH_CANSEEK) && !thisfile->bs->spill)
+          || (thisfile->maxbufs < 0 || thisfile->bs->nbufs < thisfile->maxbufs)) {
+        /*
+         * Make room in the block cache first, if this file uses it.
+         */
+        if (thisfile->bs->cached)
+          cache_trim(thisfile->bs->blksize);
         if (ch::ch_addbuf())
           /*
            * Allocation failed: turn off autobuf.
            */
           less::Globals::autobuf = option::OPT_OFF;
+      }
+    }
+    slot = thisfile->bs->tail;
+    bp   = thisfile->bs->bufs[slot];
+    spill_put(bp); /* Save the old block, if it can't be read again. */
+    if (bp->block >= 0) {
+      index_remove(thisfile->bs, bp->block);
+      fadv_drop(bp->block);
     }
-    bn = thisfile->buflist.prev;
-    bp = bufnode_buf(bn);
-    BUF_HASH_RM(bn); /* Remove from old hash chain. */
     bp->block    = thisfile->block;
     bp->datasize = 0;
-    BUF_HASH_INS(bn, h); /* Insert into new hash chain. */
+    index_insert(thisfile->bs, bp->block, slot);
 
     chDebug("ch_get - created new buf");
     chDebug(to_string(bp));
     chDebug(to_string(thisfile));
+
+    /*
+     * The block may have been spilled, or the read-ahead thread
+     * may already have read it.
+     * Either way, start reading the blocks after it.
+     */
+    bool prefetched = spill_get(bp) || ra_take(bp);
+    ra_schedule();
+    if (prefetched)
+      goto found;
   }
 
 read_more:
-  pos = (thisfile->block * LBUFSIZE) + bp->datasize; // NOLINT(clang-analyzer-core.NullDereference)
+  pos = (thisfile->block * thisfile->bs->blksize) + bp->datasize; // NOLINT(clang-analyzer-core.NullDereference)
   if ((len = length()) != NULL_POSITION && pos >= len)
     /*
      * At end of file.
      */
     return (EOI);
 
-  if (pos != thisfile->fpos) {
+  sequential = (pos == thisfile->fpos);
+  if (!sequential) {
     /*
-     * Not at the correct position: must seek.
+     * Not at the correct position.
      * If input is a pipe, we're in trouble (can't seek on a pipe).
      * Some data has been lost: just return "?".
+     * A seekable file is read with pread, so there is nothing to seek.
      */
     if (!(thisfile->flags & CH_CANSEEK))
       return ('?');
-    if (lseek(thisfile->file, pos, SEEK_SET) == BAD_LSEEK) {
-      output::error((char*)"seek output::error", NULL_PARG);
-      screen::clear_eol();
-      return (EOI);
-    }
     thisfile->fpos = pos;
   }
 
@@ -366,12 +499,14 @@ read_more:
   } else if (thisfile->flags & CH_HELPFILE) {
     bp->data[bp->datasize] = help::helpdata[thisfile->fpos];
     n                      = 1;
+  } else if (thisfile->flags & CH_CANSEEK) {
+    n = ch_fill(bp, slot, pos, sequential);
   } else {
     n = os::iread(thisfile->file, &bp->data[bp->datasize],
-        (LBUFSIZE - bp->datasize));
+        (thisfile->bs->blksize - bp->datasize));
     chDebug("os::iread result");
     chDebug("n = " + std::to_string(n));
-    chDebug(reinterpret_cast<char*>(bp->data));
+    chDebug(std::string(reinterpret_cast<char*>(bp->data), bp->datasize));
   }
 
   if (n == READ_INTR)
@@ -388,7 +523,7 @@ read_more:
    * If we have a log file, write the new data to it.
    */
   if (less::Globals::logfile >= 0 && n > 0)
-    ignore_result(write(less::Globals::logfile, (char*)&bp->data[bp->datasize], n));
+    log_put(&bp->data[bp->datasize], n);
 
   thisfile->fpos += n;
   bp->datasize += n;
@@ -399,7 +534,7 @@ read_more:
    */
   if (n == 0) {
     thisfile->fsize = pos;
-    if (less::Globals::ignore_eoi) {
+    if (less::Globals::ignore_eoi && !follow_key) {
       /*
        * We are ignoring EOF.
        * Wait a while, then try again.
@@ -410,44 +545,23 @@ read_more:
         output::ierror((char*)"%s", parg);
       }
 
-      sleep(1);
+      follow_wait();
       slept = true;
-
-#if HAVE_STAT_INO
-      if (less::Globals::follow_mode == FOLLOW_NAME) {
-        /* See whether the file's i-number has changed,
-         * or the file has shrunk.
-         * If so, force the file to be closed and
-         * reopened. */
-        struct stat st;
-        position_t  curr_pos = tell();
-        int         r        = stat(ifile::getCurrentIfile()->getFilename(), &st);
-        if (r == 0 && (st.st_ino != curr_ino || st.st_dev != curr_dev || (curr_pos != NULL_POSITION && st.st_size < curr_pos))) {
-          /* remake_display and reopen the file. */
-          screen_trashed = TRASHED_AND_REOPEN_FILE;
-          return (EOI);
-        }
-      }
-#endif
+      if (follow_name())
+        return (EOI);
     }
-    if (less::Globals::sigs)
+    if (less::Globals::sigs || follow_key)
       return (EOI);
   }
 
 found:
-  if (thisfile->buflist.next != bn) {
-    /*
-     * Move the buffer to the head of the buffer chain.
-     * This orders the buffer chain, most- to least-recently used.
-     */
-    BUF_RM(bn);
-    BUF_INS_HEAD(bn);
-
+  if (thisfile->bs->head != slot) {
     /*
-     * Move to head of hash chain too.
+     * Move the buffer to the head of the LRU list.
+     * This orders the list, most- to least-recently used.
      */
-    BUF_HASH_RM(bn);
-    BUF_HASH_INS(bn, h);
+    lru_unlink(thisfile->bs, slot);
+    lru_push_head(thisfile->bs, slot);
   }
   if (thisfile->offset >= bp->datasize)
     /*
@@ -459,7 +573,7 @@ found:
   chDebug("ch_get - read block");
   chDebug(to_string(bp));
   chDebug(to_string(thisfile));
-  chDebug(reinterpret_cast<char*>(bp->data));
+  chDebug(std::string(reinterpret_cast<char*>(bp->data), bp->datasize));
 
   return (bp->data[thisfile->offset]);
 }
@@ -476,6 +590,338 @@ void ungetchar(int c)
   ch_ungotchar = c;
 }
 
+namespace {
+  /*
+   * Read a non-seekable file forward until thisfile->fpos reaches pos,
+   * or to end of file if pos is NULL_POSITION, leaving the read pointer
+   * at the end of the data read.
+   * This is what a loop of forw_get calls would do, but a whole read
+   * is taken at a time rather than a char: the read pointer is put at
+   * thisfile->fpos, so each ch_get reads as much as the pipe gives us.
+   * Return 0 on success, 1 at end of file before pos, or if interrupted.
+   */
+  static int ch_drain(position_t pos)
+  {
+    int c = 0;
+
+    while (pos == NULL_POSITION || thisfile->fpos < pos) {
+      thisfile->block  = thisfile->fpos / thisfile->bs->blksize;
+      thisfile->offset = static_cast<unsigned int>(thisfile->fpos % thisfile->bs->blksize);
+      c                = ch_get();
+      if (c == EOI || is_abort_signal(less::Globals::sigs))
+        break;
+    }
+    thisfile->block  = thisfile->fpos / thisfile->bs->blksize;
+    thisfile->offset = static_cast<unsigned int>(thisfile->fpos % thisfile->bs->blksize);
+    if (is_abort_signal(less::Globals::sigs))
+      return (1);
+    return (c == EOI && pos != NULL_POSITION) ? 1 : 0;
+  }
+
+  /*
+   * Follow mode.
+   * At end of file with ignore_eoi set, wait for the file to grow.
+   * A regular file is watched with inotify and a pipe is polled itself,
+   * together with the terminal: a keystroke sets follow_key, which
+   * ends the wait (but is not an interrupt, so -K doesn't quit), and
+   * the key is then read as the next command.
+   * A regular file is also looked at again every second, since inotify
+   * misses writes made by other clients of a network file system, and
+   * the file may be replaced by another of the same name (--follow-name).
+   */
+  static int ino_fd = -1; /* inotify instance; -2 if none possible */
+
+  /*
+   * What follow_wait has seen happen to the file.
+   */
+  static int follow_events = 0;
+#define FOLLOW_RENAMED 01 /* The name may now refer to another file */
+#define FOLLOW_CHANGED 02 /* The file may have been truncated */
+
+  static bool follow_watch()
+  {
+#if HAVE_INOTIFY
+    char path[64];
+
+    if (ino_fd == -1) {
+      ino_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (ino_fd < 0)
+        ino_fd = -2;
+    }
+    thisfile->watch = -2;
+    if (ino_fd < 0)
+      return (false);
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", thisfile->file);
+    thisfile->watch = inotify_add_watch(ino_fd, path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+    if (thisfile->watch < 0) {
+      thisfile->watch = -2;
+      return (false);
+    }
+    if (less::Globals::follow_mode == FOLLOW_NAME && thisfile->dwatch == -1) {
+      /*
+       * Watch the directory too, for a new file of the same name.
+       */
+      std::string dir  = ifile::getCurrentIfile()->getFilename();
+      size_t      dirn = dir.rfind('/');
+
+      dir              = (dirn == std::string::npos) ? "." : dir.substr(0, std::max<size_t>(dirn, 1));
+      thisfile->dwatch = inotify_add_watch(ino_fd, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+      if (thisfile->dwatch < 0)
+        thisfile->dwatch = -2;
+    }
+    return (true);
+#else
+    thisfile->watch = -2;
+    return (false);
+#endif
+  }
+
+  static void follow_wait()
+  {
+    struct pollfd fds[2];
+    int           nfds    = 0;
+    int           timeout = -1;
+
+    if (thisfile->flags & CH_HELPFILE) {
+      sleep(1);
+      return;
+    }
+    if (thisfile->flags & CH_CANSEEK) {
+      /*
+       * Data may have been written since we last read: having just
+       * started watching, read again before waiting.
+       */
+      if (thisfile->watch == -1 && follow_watch())
+        return;
+      if (thisfile->watch >= 0) {
+        fds[nfds].fd     = ino_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+      }
+    } else if (thisfile->watch == -1) {
+      /*
+       * A pipe is readable until its writer closes it.
+       */
+      fds[nfds].fd     = thisfile->file;
+      fds[nfds].events = POLLIN;
+      nfds++;
+    }
+    if (thisfile->flags & CH_CANSEEK)
+      timeout = 1000;
+    fds[nfds].fd     = tty;
+    fds[nfds].events = POLLIN;
+    nfds++;
+
+    int r = poll(fds, nfds, timeout);
+    if (r == 0) {
+      /*
+       * Timed out: we don't know what has happened, so look.
+       */
+      follow_events |= FOLLOW_RENAMED | FOLLOW_CHANGED;
+      return;
+    }
+    if (r < 0)
+      return;
+    if (fds[nfds - 1].revents & POLLIN)
+      follow_key = true;
+#if HAVE_INOTIFY
+    if (nfds > 1 && fds[0].fd == ino_fd && (fds[0].revents & POLLIN)) {
+      alignas(struct inotify_event) char events[4096];
+      const char*                        name = ifile::getCurrentIfile()->getFilename();
+      ssize_t                            len;
+
+      if (strrchr(name, '/') != nullptr)
+        name = strrchr(name, '/') + 1;
+      while ((len = read(ino_fd, events, sizeof(events))) > 0) {
+        const struct inotify_event* ev;
+        for (char* p = events; p < events + len; p += sizeof(struct inotify_event) + ev->len) {
+          ev = reinterpret_cast<const struct inotify_event*>(p);
+          if (ev->wd == thisfile->watch) {
+            if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB))
+              follow_events |= FOLLOW_RENAMED;
+            if (ev->mask & IN_MODIFY)
+              follow_events |= FOLLOW_CHANGED;
+            if (ev->mask & IN_IGNORED)
+              thisfile->watch = -2; /* The file has gone */
+          } else if (ev->wd == thisfile->dwatch && ev->len > 0 && strcmp(ev->name, name) == 0)
+            follow_events |= FOLLOW_RENAMED;
+        }
+      }
+    }
+#endif
+    if (nfds > 1 && fds[0].fd == thisfile->file && (fds[0].revents & POLLHUP) && !(fds[0].revents & POLLIN))
+      /*
+       * The writer has gone: there will be nothing more to read.
+       */
+      thisfile->watch = -2;
+  }
+
+  /*
+   * Chain the file now at the current file's name on after it.
+   * The file must be at end of file.
+   * Return false if that can't be done.
+   */
+  static bool follow_chain()
+  {
+    struct stat       st;
+    struct chainlink* chain;
+    int               f;
+
+    if (!(thisfile->flags & CH_CANSEEK) || (thisfile->flags & (CH_HELPFILE | CH_NODATA | CH_POPENED))
+        || thisfile->bs->users > 1)
+      return (false);
+    if (fstat(thisfile->file, &st) < 0 || st.st_size > thisfile->fpos - thisfile->base)
+      /*
+       * The old file isn't at end of file: it has grown since we read it.
+       */
+      return (false);
+    f = open(ifile::getCurrentIfile()->getFilename(), O_RDONLY);
+    if (f < 0)
+      return (false);
+    if (fstat(f, &st) < 0 || !S_ISREG(st.st_mode)) {
+      ::close(f);
+      return (false);
+    }
+    chain = (struct chainlink*)realloc(thisfile->chain, (thisfile->nchain + 1) * sizeof(struct chainlink));
+    if (chain == nullptr) {
+      ::close(f);
+      return (false);
+    }
+
+    ra_cancel();
+#if HAVE_MMAP
+    ch_unmap();
+#endif
+    fadv_close();
+    follow_stop();
+    if (thisfile->bs->cached) {
+      /*
+       * The buffers no longer hold just the one file's data.
+       */
+      cache_used -= static_cast<position_t>(thisfile->bs->nbufs) * thisfile->bs->blksize;
+      cache_unlink(thisfile->bs);
+      thisfile->bs->cached = false;
+    }
+    thisfile->chain                   = chain;
+    thisfile->chain[thisfile->nchain] = { thisfile->file, thisfile->base };
+    thisfile->nchain++;
+    thisfile->file = f;
+    thisfile->base = thisfile->fpos;
+#if HAVE_STAT_INO
+    curr_ino = st.st_ino;
+    curr_dev = st.st_dev;
+#endif
+    return (true);
+  }
+
+  /*
+   * In --follow-name mode, see whether the file's name now refers to
+   * another file, or the file has shrunk.
+   * Rather than stat the name at every end of file, we look only when
+   * follow_wait has seen something happen (or has timed out).
+   * A new file is chained on after the old one; if that can't be done,
+   * or the file has been truncated, the file is closed and reopened.
+   * Return true if it must be reopened.
+   */
+  static bool follow_name()
+  {
+#if HAVE_STAT_INO
+    struct stat st;
+    position_t  curr_pos = tell();
+
+    if (less::Globals::follow_mode != FOLLOW_NAME)
+      return (false);
+    if (follow_events & FOLLOW_CHANGED) {
+      follow_events &= ~FOLLOW_CHANGED;
+      if (fstat(thisfile->file, &st) == 0 && curr_pos != NULL_POSITION && st.st_size < curr_pos - thisfile->base) {
+        screen_trashed = TRASHED_AND_REOPEN_FILE;
+        return (true);
+      }
+    }
+    if (follow_events & FOLLOW_RENAMED) {
+      /*
+       * If there is no file of that name (yet), look again next time.
+       */
+      if (stat(ifile::getCurrentIfile()->getFilename(), &st) != 0)
+        return (false);
+      if (st.st_ino == curr_ino && st.st_dev == curr_dev) {
+        follow_events &= ~FOLLOW_RENAMED;
+        return (false);
+      }
+      if (follow_chain()) {
+        follow_events = 0;
+        return (false);
+      }
+      screen_trashed = TRASHED_AND_REOPEN_FILE;
+      return (true);
+    }
+#endif
+    return (false);
+  }
+
+  /*
+   * Stop watching the current file.
+   */
+  static void follow_stop()
+  {
+#if HAVE_INOTIFY
+    if (thisfile->watch >= 0 && ino_fd >= 0)
+      inotify_rm_watch(ino_fd, thisfile->watch);
+    if (thisfile->dwatch >= 0 && ino_fd >= 0 && thisfile->dwatch != thisfile->watch)
+      inotify_rm_watch(ino_fd, thisfile->dwatch);
+#endif
+    thisfile->watch  = -1;
+    thisfile->dwatch = -1;
+    follow_events    = 0;
+  }
+
+  /*
+   * Which file holds the data at pos, at what offset?
+   * *endp is set to where the data in that file ends,
+   * or NULL_POSITION for the current file.
+   */
+  static int chain_source(position_t pos, position_t* offp, position_t* endp)
+  {
+    int i;
+
+    if (pos >= thisfile->base) {
+      *offp = pos - thisfile->base;
+      *endp = NULL_POSITION;
+      return (thisfile->file);
+    }
+    for (i = thisfile->nchain - 1; i > 0 && thisfile->chain[i].start > pos; i--)
+      ;
+    *offp = pos - thisfile->chain[i].start;
+    *endp = (i + 1 < thisfile->nchain) ? thisfile->chain[i + 1].start : thisfile->base;
+    return (thisfile->chain[i].file);
+  }
+
+  /*
+   * The size of the file, including any earlier files it's chained on to.
+   */
+  static position_t chain_size()
+  {
+    position_t size = filename::filesize(thisfile->file);
+
+    if (size == NULL_POSITION)
+      return (NULL_POSITION);
+    return (thisfile->base + size);
+  }
+
+  /*
+   * Close the earlier files in a chain.
+   */
+  static void chain_close()
+  {
+    for (int i = 0; i < thisfile->nchain; i++)
+      ::close(thisfile->chain[i].file);
+    free(thisfile->chain);
+    thisfile->chain  = nullptr;
+    thisfile->nchain = 0;
+    thisfile->base   = 0;
+  }
+} // namespace
+
 /*
  * Close the logfile.
  * If we haven't read all of standard input into it, do that now.
@@ -490,10 +936,9 @@ void end_logfile()
   if (!tried && thisfile->fsize == NULL_POSITION) {
     tried = true;
     output::ierror((char*)"Finishing logfile", NULL_PARG);
-    while (forw_get() != EOI)
-      if (is_abort_signal(less::Globals::sigs))
-        break;
+    ch_drain(NULL_POSITION);
   }
+  log_flush();
   ::close(less::Globals::logfile);
   less::Globals::logfile = -1;
   free(less::Globals::namelogfile);
@@ -508,23 +953,27 @@ void end_logfile()
 
 void sync_logfile()
 {
-  struct buf*     bp;
-  struct bufnode* bn;
-  bool            warned = false;
-  blocknum_t      block;
-  blocknum_t      nblocks;
+  struct buf* bp;
+  int         slot;
+  bool        warned = false;
+  blocknum_t  block;
+  blocknum_t  nblocks;
 
-  nblocks = (thisfile->fpos + LBUFSIZE - 1) / LBUFSIZE;
+  nblocks = (thisfile->fpos + thisfile->bs->blksize - 1) / thisfile->bs->blksize;
   for (block = 0; block < nblocks; block++) {
     bool wrote = false;
-    FOR_BUFS(bn)
-    {
-      bp = bufnode_buf(bn);
-      if (bp->block == block) {
-        ignore_result(write(less::Globals::logfile, (char*)bp->data, bp->datasize));
+    if ((slot = index_find(thisfile->bs, block)) >= 0) {
+      bp = thisfile->bs->bufs[slot];
+      log_put(bp->data, bp->datasize);
+      wrote = true;
+    } else if (spilled(block)) {
+      unsigned char* data = (unsigned char*)utils::ecalloc(1, thisfile->bs->blksize);
+      int            n    = spill_read(block, data);
+      if (n > 0) {
+        log_put(data, n);
         wrote = true;
-        break;
       }
+      free(data);
     }
     if (!wrote && !warned) {
       output::error((char*)"Warning: log file is incomplete", NULL_PARG);
@@ -538,18 +987,9 @@ void sync_logfile()
  */
 static bool buffered(blocknum_t block)
 {
-  struct buf*     bp;
-  struct bufnode* bn;
-  int             h;
-
-  h = BUFHASH(block);
-  FOR_BUFS_IN_CHAIN(h, bn)
-  {
-    bp = bufnode_buf(bn);
-    if (bp->block == block)
-      return (true);
-  }
-  return (false);
+  if (index_find(thisfile->bs, block) >= 0)
+    return (true);
+  return (spilled(block));
 }
 
 /*
@@ -572,7 +1012,7 @@ int seek(position_t pos)
   if (pos < ch_zero || (len != NULL_POSITION && pos > len))
     return (1);
 
-  new_block = pos / LBUFSIZE;
+  new_block = pos / thisfile->bs->blksize;
 
   // unit_test - log("new_block = " + std::to_string(new_block));
   // unit_test - log("flags = " + std::to_string(thisfile->flags));
@@ -583,19 +1023,17 @@ int seek(position_t pos)
 
     if (thisfile->fpos > pos)
       return (1);
-    while (thisfile->fpos < pos) {
-      if (forw_get() == EOI)
-        return (1);
-      if (is_abort_signal(less::Globals::sigs))
-        return (1);
-    }
-    return (0);
+    if (ch_drain(pos))
+      return (1);
+    /*
+     * The block holding pos was the last one read, so it's buffered.
+     */
   }
   /*
    * Set read pointer.
    */
   thisfile->block  = new_block;
-  thisfile->offset = pos % LBUFSIZE;
+  thisfile->offset = static_cast<unsigned int>(pos % thisfile->bs->blksize);
   return (0);
 }
 
@@ -611,7 +1049,7 @@ int end_seek()
     return (0);
 
   if (thisfile->flags & CH_CANSEEK)
-    thisfile->fsize = filename::filesize(thisfile->file);
+    thisfile->fsize = chain_size();
 
   len = length();
   if (len != NULL_POSITION)
@@ -620,10 +1058,7 @@ int end_seek()
   /*
    * Do it the slow way: read till end of data.
    */
-  while (forw_get() != EOI)
-    if (is_abort_signal(less::Globals::sigs))
-      return (1);
-  return (0);
+  return (ch_drain(NULL_POSITION));
 }
 
 /*
@@ -632,22 +1067,24 @@ int end_seek()
 
 int end_buffer_seek()
 {
-  struct buf*     bp;
-  struct bufnode* bn;
-  position_t      buf_pos;
-  position_t      end_pos;
+  struct buf* bp;
+  int         slot;
+  position_t  buf_pos;
+  position_t  end_pos;
 
   if (thisfile == nullptr || (thisfile->flags & CH_CANSEEK))
     return (end_seek());
 
   end_pos = 0;
-  FOR_BUFS(bn)
+  FOR_BUFS(slot)
   {
-    bp      = bufnode_buf(bn);
-    buf_pos = (bp->block * LBUFSIZE) + bp->datasize;
+    bp      = thisfile->bs->bufs[slot];
+    buf_pos = (bp->block * thisfile->bs->blksize) + bp->datasize;
     if (buf_pos > end_pos)
       end_pos = buf_pos;
   }
+  if (thisfile->bs->spillend > end_pos)
+    end_pos = thisfile->bs->spillend;
 
   return (seek(end_pos));
 }
@@ -660,8 +1097,9 @@ int end_buffer_seek()
 
 int beg_seek()
 {
-  struct bufnode* bn;
-  struct bufnode* firstbn;
+  struct buf* bp;
+  struct buf* firstbp;
+  int         slot;
 
   /*
    * Try a plain seek first.
@@ -673,15 +1111,16 @@ int beg_seek()
    * Can't get to position 0.
    * Look thru the buffers for the one closest to position 0.
    */
-  firstbn = thisfile->buflist.next;
-  if (firstbn == END_OF_CHAIN)
+  firstbp = HEAD_BUF();
+  if (firstbp == nullptr)
     return (1);
-  FOR_BUFS(bn)
+  FOR_BUFS(slot)
   {
-    if (bufnode_buf(bn)->block < bufnode_buf(firstbn)->block)
-      firstbn = bn;
+    bp = thisfile->bs->bufs[slot];
+    if (bp->block < firstbp->block)
+      firstbp = bp;
   }
-  thisfile->block  = bufnode_buf(firstbn)->block;
+  thisfile->block  = firstbp->block;
   thisfile->offset = 0;
 
   chDebug("beg_seek");
@@ -713,7 +1152,7 @@ position_t tell()
 {
   if (thisfile == nullptr)
     return (NULL_POSITION);
-  return (thisfile->block * LBUFSIZE) + thisfile->offset;
+  return (thisfile->block * thisfile->bs->blksize) + thisfile->offset;
 }
 
 /*
@@ -729,11 +1168,12 @@ int forw_get()
   c = ch_get();
   if (c == EOI)
     return (EOI);
-  if (thisfile->offset < LBUFSIZE - 1)
+  if (thisfile->offset < thisfile->bs->blksize - 1)
     thisfile->offset++;
   else {
     thisfile->block++;
     thisfile->offset = 0;
+    ra_dir = 1;
   }
   return (c);
 }
@@ -755,158 +1195,1833 @@ int back_get()
     if (!(thisfile->flags & CH_CANSEEK) && !buffered(thisfile->block - 1))
       return (EOI);
     thisfile->block--;
-    thisfile->offset = LBUFSIZE - 1;
+    thisfile->offset = thisfile->bs->blksize - 1;
+    ra_dir           = -1;
   }
   return (ch_get());
 }
 
 /*
- * Set max amount of buffer space.
- * bufspace is in units of 1024 bytes. -1 means no limit.
+ * Get the longest run of contiguous data, starting at the read pointer,
+ * which is available without any further reading.
+ * *spanp is set to point to the data and its length is returned;
+ * 0 means we are at end of file.
+ * The read pointer is not moved; the caller seeks past whatever
+ * it consumes.  The span is only valid until the next call into ch.
  */
 
-void setbufspace(int bufspace)
+int get_span(const unsigned char** spanp)
 {
-  if (bufspace < 0)
-    maxbufs = -1;
-  else {
-    maxbufs = ((bufspace * 1024) + LBUFSIZE - 1) / LBUFSIZE;
-    if (maxbufs < 1)
-      maxbufs = 1;
+  static unsigned char onechar;
+  struct buf*          bp;
+  int                  c;
+
+  if (thisfile == nullptr)
+    return (0);
+  ra_dir = 1;
+  c      = ch_get();
+  if (c == EOI)
+    return (0);
+
+#if HAVE_MMAP
+  if (thisfile->mapaddr != nullptr) {
+    position_t pos = tell();
+    if (pos < thisfile->mapsize) {
+      /*
+       * No more than a block at a time, so a shrunk file is noticed
+       * (map_check) within a block of where it ends.
+       */
+      *spanp = &thisfile->mapaddr[pos];
+      return static_cast<int>(std::min<position_t>(thisfile->mapsize - pos, thisfile->bs->blksize));
+    }
+  }
+#endif
+
+  /*
+   * ch_get leaves the buffer it read from at the head of the chain.
+   */
+  if ((bp = HEAD_BUF()) != nullptr) {
+    if (bp->block == thisfile->block && thisfile->offset < bp->datasize) {
+      *spanp = &bp->data[thisfile->offset];
+      return static_cast<int>(bp->datasize - thisfile->offset);
+    }
   }
+
+  /*
+   * The char didn't come from a buffer (e.g. data has been lost
+   * from a pipe and ch_get gave us a '?').
+   */
+  onechar = static_cast<unsigned char>(c);
+  *spanp  = &onechar;
+  return (1);
 }
 
 /*
- * Flush (discard) any saved file state, including buffer contents.
+ * Like get_span, but get the run of contiguous data which ends
+ * just before the read pointer.  *spanp points to the first char
+ * of the run.  0 means we are at the beginning of the file
+ * (or the preceding data is no longer available).
  */
 
-void flush()
+int get_span_back(const unsigned char** spanp)
 {
-  struct bufnode* bn;
+  static unsigned char onechar;
+  struct buf*          bp;
+  blocknum_t           save_block;
+  unsigned int         save_offset;
+  int                  c;
+  int                  n;
 
   if (thisfile == nullptr)
-    return;
+    return (0);
 
-  if (!(thisfile->flags & CH_CANSEEK)) {
-    /*
-     * If input is a pipe, we don't flush buffer contents,
-     * since the contents can't be recovered.
-     */
-    thisfile->fsize = NULL_POSITION;
-    return;
+#if HAVE_MMAP
+  if (map_fault)
+    map_check();
+  if (thisfile->mapaddr != nullptr) {
+    position_t pos = tell();
+    if (pos <= thisfile->mapsize) {
+      n      = static_cast<int>(std::min<position_t>(pos, thisfile->bs->blksize));
+      *spanp = &thisfile->mapaddr[pos - n];
+      return (n);
+    }
   }
+#endif
 
   /*
-   * Initialize all the buffers.
+   * Step back onto the previous char, so that its block is read
+   * into the head buffer, then put the read pointer back.
    */
-  FOR_BUFS(bn) { bufnode_buf(bn)->block = -1; }
+  save_block  = thisfile->block;
+  save_offset = thisfile->offset;
+  c           = back_get();
+  n           = 0;
+  if (c != EOI) {
+    if ((bp = HEAD_BUF()) != nullptr
+        && bp->block == thisfile->block
+        && thisfile->offset < bp->datasize) {
+      *spanp = &bp->data[0];
+      n      = static_cast<int>(thisfile->offset + 1);
+    } else {
+      onechar = static_cast<unsigned char>(c);
+      *spanp  = &onechar;
+      n       = 1;
+    }
+  }
+  thisfile->block  = save_block;
+  thisfile->offset = save_offset;
+  return (n);
+}
+
+/*
+ * Return the max number of buffers for a file with the given block size.
+ * -1 means no limit.
+ */
+static int ch_maxbufs(unsigned int blksize)
+{
+  position_t n;
+
+  if (maxbufspace < 0)
+    return (-1);
+  n = (maxbufspace + blksize - 1) / blksize;
+  /*
+   * With big blocks, a screenful can easily straddle two blocks;
+   * keep enough of them that moving around doesn't thrash.
+   */
+  if (blksize > LBUFSIZE && n < MIN_BIGBUFS)
+    n = MIN_BIGBUFS;
+  if (n < 1)
+    n = 1;
+  return static_cast<int>(std::min<position_t>(n, INT_MAX));
+}
+
+/*
+ * Set max amount of buffer space.
+ * bufspace is in units of 1024 bytes. -1 means no limit.
+ */
+
+void setbufspace(int bufspace)
+{
+  if (bufspace < 0)
+    maxbufspace = -1;
+  else
+    maxbufspace = static_cast<position_t>(bufspace) * 1024;
+  if (thisfile != nullptr)
+    thisfile->maxbufs = ch_maxbufs(thisfile->bs->blksize);
+}
+
+/*
+ * Reset the file state for the current file: forget its size and
+ * go back to the beginning.  Unless keepdata is set (the buffers
+ * are known to still hold the current contents of the file),
+ * the buffer contents are discarded too.
+ */
+static void ch_flush(bool keepdata)
+{
+  int slot;
+
+  if (thisfile == nullptr)
+    return;
+
+  /*
+   * Anything read ahead may be stale now.
+   */
+  ra_cancel();
+
+  if (!(thisfile->flags & CH_CANSEEK)) {
+    /*
+     * If input is a pipe, we don't flush buffer contents,
+     * since the contents can't be recovered.
+     */
+    thisfile->fsize = NULL_POSITION;
+    return;
+  }
+
+  /*
+   * Initialize all the buffers.
+   */
+  if (!keepdata) {
+    FOR_BUFS(slot) { thisfile->bs->bufs[slot]->block = -1; }
+    index_clear(thisfile->bs);
+    if (thisfile->bs->cached)
+      cache_stamp(thisfile->bs, thisfile->file);
+  }
 
   /*
    * Figure out the size of the file, if we can.
    */
-  thisfile->fsize = filename::filesize(thisfile->file);
+  thisfile->fsize = chain_size();
+
+  /*
+   * Seek to a known position: the beginning of the file.
+   */
+  thisfile->fpos = 0;
+  // log("flush-> fpos = " + std::to_string(thisfile->fpos));
+  thisfile->block  = 0; /* thisfile->fpos / thisfile->bs->blksize; */
+  thisfile->offset = 0; /* thisfile->fpos % thisfile->bs->blksize; */
+
+#if 1
+  /*
+   * This is a kludge to workaround a Linux kernel bug: files in
+   * /proc have a size of 0 according to fstat() but have readable
+   * data.  They are sometimes, but not always, seekable.
+   * Force them to be non-seekable here.
+   */
+  if (thisfile->fsize == 0) {
+    thisfile->fsize = NULL_POSITION;
+    thisfile->flags &= ~CH_CANSEEK;
+  }
+#endif
+
+#if HAVE_MMAP
+  /*
+   * Map the file into memory, if we've been asked to.
+   * If that isn't possible we just use the buffers.
+   */
+  ch_map();
+#endif
+  fadv_start();
+
+  if (lseek(thisfile->file, (off_t)0, SEEK_SET) == BAD_LSEEK) {
+    /*
+     * Warning only; even if the seek fails for some reason,
+     * there's a good chance we're at the beginning anyway.
+     * {{ I think this is bogus reasoning. }}
+     */
+    output::error((char*)"seek output::error to 0", NULL_PARG);
+  }
+
+  chDebug("flush");
+  chDebug(to_string(thisfile));
+}
+
+/*
+ * Flush (discard) any saved file state, including buffer contents.
+ */
+
+void flush()
+{
+  ch_flush(false);
+}
+
+namespace {
+  /*
+   * Allocate a new buffer.
+   * The buffer is added to the tail of the buffer chain.
+   */
+  static int ch_addbuf()
+  {
+    struct blockset* bs = thisfile->bs;
+    struct buf*      bp;
+
+    /*
+     * Make room for another slot.
+     */
+    if (bs->nbufs == bs->nslots) {
+      int             nslots = (bs->nslots > 0) ? bs->nslots * 2 : 16;
+      struct buf**    bufs;
+      struct lrulink* lru;
+
+      bufs = (struct buf**)realloc(bs->bufs, nslots * sizeof(struct buf*));
+      if (bufs == nullptr)
+        return (1);
+      bs->bufs = bufs;
+      lru      = (struct lrulink*)realloc(bs->lru, nslots * sizeof(struct lrulink));
+      if (lru == nullptr)
+        return (1);
+      bs->lru    = lru;
+      bs->nslots = nslots;
+    }
+
+    /*
+     * Allocate and initialize a new buffer and link it
+     * onto the tail of the LRU list.
+     */
+    bp = buf_alloc(bs, thisfile->maxbufs);
+    if (bp == nullptr)
+      return (1);
+    if (bs->cached)
+      cache_used += bs->blksize;
+    bp->block    = -1;
+    bp->datasize = 0;
+
+    bs->bufs[bs->nbufs] = bp;
+    lru_push_tail(bs, bs->nbufs);
+    bs->nbufs++;
+
+    chDebug("ch_addbuf add buff:");
+    chDebug(to_string(bp));
+    chDebug("------------------------ thisfile now ------------------------\n");
+    chDebug(to_string(thisfile));
+    chDebug("--------------------------------------------------------------\n");
+    return (0);
+  }
+
+  /*
+   * Read from a seekable file, at pos, into the buffer bp (in slot).
+   * If the file is being read sequentially, and bp is empty, also fill
+   * buffers for the blocks following bp's, up to FILL_BLOCKS in all,
+   * with the same preadv.  The extra buffers are taken from the tail
+   * of the LRU list (or newly allocated, if that's allowed and needs
+   * nothing evicted from the block cache) and put at its head, so
+   * that they are still there when wanted.  At most half the buffers
+   * are used this way, so the blocks on screen aren't pushed out.
+   * Return the number of bytes read into bp, as iread does.
+   */
+  static int ch_fill(struct buf* bp, int slot, position_t pos, bool sequential)
+  {
+    struct blockset* bs = thisfile->bs;
+    struct iovec     iov[FILL_BLOCKS];
+    struct buf*      fill[FILL_BLOCKS];
+    int              nfill = 0;
+    int              limit = FILL_BLOCKS;
+    position_t       len   = length();
+    position_t       off;
+    position_t       end;
+    int              file;
+    int              n;
+
+    iov[0].iov_base = &bp->data[bp->datasize];
+    iov[0].iov_len  = bs->blksize - bp->datasize;
+
+    /*
+     * Don't read past the end of an earlier file in a chain.
+     */
+    file = chain_source(pos, &off, &end);
+    if (end != NULL_POSITION) {
+      iov[0].iov_len = static_cast<size_t>(std::min<position_t>(iov[0].iov_len, end - pos));
+      limit          = 1;
+    } else if (sequential && bp->datasize == 0 && less::Globals::read_ahead <= 0
+        && less::Globals::logfile < 0) {
+      if (thisfile->maxbufs >= 0 && thisfile->maxbufs / 2 < limit)
+        limit = thisfile->maxbufs / 2;
+      if (len != NULL_POSITION && (len - pos + bs->blksize - 1) / bs->blksize < limit)
+        limit = static_cast<int>((len - pos + bs->blksize - 1) / bs->blksize);
+    } else
+      limit = 1;
+
+    while (nfill + 1 < limit) {
+      blocknum_t block = bp->block + nfill + 1;
+      int        s;
+
+      if (index_find(bs, block) >= 0)
+        break;
+      if ((thisfile->maxbufs < 0 || bs->nbufs < thisfile->maxbufs)
+          && (!bs->cached || less::Globals::cache_size < 0
+              || cache_used + bs->blksize <= static_cast<position_t>(less::Globals::cache_size) * 1024)
+          && ch_addbuf() == 0)
+        s = bs->tail;
+      else {
+        s = bs->tail;
+        if (s == slot)
+          s = bs->lru[s].prev;
+        if (s < 0)
+          break;
+      }
+      struct buf* fbp = bs->bufs[s];
+      if (fbp->block >= 0) {
+        index_remove(bs, fbp->block);
+        fadv_drop(fbp->block);
+      }
+      fbp->block    = block;
+      fbp->datasize = 0;
+      index_insert(bs, block, s);
+      lru_unlink(bs, s);
+      lru_push_head(bs, s);
+      fill[nfill]             = fbp;
+      iov[nfill + 1].iov_base = fbp->data;
+      iov[nfill + 1].iov_len  = bs->blksize;
+      nfill++;
+    }
+
+    int f = (file == thisfile->file) ? direct_file(iov, nfill + 1, off) : file;
+    n     = os::ipreadv(f, iov, nfill + 1, off);
+    if (n < 0 && f != file) {
+      /*
+       * The file system may not allow O_DIRECT after all.
+       */
+      direct_fail();
+      n = os::ipreadv(file, iov, nfill + 1, off);
+    }
+    if (sequential && n > 0)
+      fadv_ahead(pos + n);
+
+    /*
+     * Share out what we got.  Buffers which got nothing are put back.
+     */
+    position_t rest = (n > 0) ? n - static_cast<position_t>(iov[0].iov_len) : 0;
+    for (int i = 0; i < nfill; i++) {
+      struct buf* fbp = fill[i];
+      if (rest > 0) {
+        fbp->datasize = static_cast<unsigned int>(std::min<position_t>(rest, bs->blksize));
+        rest -= fbp->datasize;
+      } else {
+        int s = index_find(bs, fbp->block);
+        index_remove(bs, fbp->block);
+        fbp->block = -1;
+        lru_unlink(bs, s);
+        lru_push_tail(bs, s);
+      }
+    }
+    if (n > static_cast<int>(iov[0].iov_len)) {
+      thisfile->fpos += n - static_cast<int>(iov[0].iov_len);
+      n = static_cast<int>(iov[0].iov_len);
+    }
+    return (n);
+  }
+
+  /*
+   * Page cache hints.
+   *
+   * Normally the pages of a file we read stay in the system's page
+   * cache, so paging through a huge file can push out everything else.
+   * With --fadvise, a seekable file is read with POSIX_FADV_SEQUENTIAL,
+   * the data just ahead of a sequential reader is asked for with
+   * POSIX_FADV_WILLNEED, and a block's pages are dropped with
+   * POSIX_FADV_DONTNEED when it leaves the buffer pool, and the whole
+   * file's when it is closed (anything we keep is in the block cache).
+   * The page cache then holds little more than our own buffers.
+   *
+   * With --direct-io, empty buffers of a seekable file are read with
+   * O_DIRECT, through a second descriptor, bypassing the page cache.
+   * This works because block sizes and buffers are page aligned.
+   * If the file system refuses it, we go back to normal reads.
+   */
+  static bool fadvising()
+  {
+    return (less::Globals::fadvise && (thisfile->flags & CH_CANSEEK)
+        && !(thisfile->flags & CH_HELPFILE) && thisfile->nchain == 0);
+  }
+
+  static void fadv_start()
+  {
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fadvising())
+      posix_fadvise(thisfile->file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+
+  static void fadv_ahead(position_t pos)
+  {
+#ifdef POSIX_FADV_WILLNEED
+    if (fadvising())
+      posix_fadvise(thisfile->file, pos, static_cast<off_t>(FILL_BLOCKS) * thisfile->bs->blksize,
+          POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  static void fadv_drop(blocknum_t block)
+  {
+#ifdef POSIX_FADV_DONTNEED
+    if (fadvising())
+      posix_fadvise(thisfile->file, block * thisfile->bs->blksize, thisfile->bs->blksize,
+          POSIX_FADV_DONTNEED);
+#endif
+  }
+
+  static void fadv_close()
+  {
+#ifdef POSIX_FADV_DONTNEED
+    if (fadvising() && thisfile->file >= 0)
+      posix_fadvise(thisfile->file, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    if (thisfile->dfile >= 0)
+      ::close(thisfile->dfile);
+    thisfile->dfile = -1;
+  }
+
+  /*
+   * Return the descriptor to read into iov from pos with: the O_DIRECT
+   * one if --direct-io is set and pos and all the buffers are page aligned.
+   */
+  static int direct_file(struct iovec* iov, int iovcnt, position_t pos)
+  {
+#ifdef O_DIRECT
+    if (!less::Globals::direct_io || thisfile->dfile == -2 || (thisfile->flags & CH_HELPFILE)
+        || (pos & (page_size() - 1)))
+      return (thisfile->file);
+    for (int i = 0; i < iovcnt; i++)
+      if ((reinterpret_cast<uintptr_t>(iov[i].iov_base) | iov[i].iov_len) & (page_size() - 1))
+        return (thisfile->file);
+    if (thisfile->dfile < 0) {
+      char path[64];
+      snprintf(path, sizeof(path), "/proc/self/fd/%d", thisfile->file);
+      thisfile->dfile = open(path, O_RDONLY | O_DIRECT);
+      if (thisfile->dfile < 0) {
+        thisfile->dfile = -2;
+        return (thisfile->file);
+      }
+    }
+    return (thisfile->dfile);
+#else
+    (void)iov;
+    (void)iovcnt;
+    (void)pos;
+    return (thisfile->file);
+#endif
+  }
+
+  /*
+   * Stop using O_DIRECT for the current file.
+   */
+  static void direct_fail()
+  {
+    if (thisfile->dfile >= 0)
+      ::close(thisfile->dfile);
+    thisfile->dfile = -2;
+  }
+
+#if HAVE_MMAP
+  /*
+   * Remove the memory mapping of the current file, if there is one.
+   */
+  static void ch_unmap()
+  {
+    if (thisfile->mapaddr == nullptr)
+      return;
+    munmap(thisfile->mapaddr, (size_t)thisfile->mapsize);
+    thisfile->mapaddr = nullptr;
+    thisfile->mapsize = 0;
+  }
+
+  /*
+   * SIGBUS handler: a read from the mapping was past the end of the
+   * file, which has shrunk.  Map zero pages over the rest of the
+   * mapping, so the read (and any others before map_check) gets zeros.
+   * A fault anywhere else is left to kill us as usual.
+   */
+  static void map_bus(int sig, siginfo_t* info, void* context)
+  {
+    unsigned char* a = static_cast<unsigned char*>(info->si_addr);
+
+    (void)context;
+    if (thisfile != nullptr && thisfile->mapaddr != nullptr && a >= thisfile->mapaddr
+        && a < thisfile->mapaddr + thisfile->mapsize) {
+      size_t off = static_cast<size_t>(a - thisfile->mapaddr) / page_size() * page_size();
+      if (mmap(thisfile->mapaddr + off, static_cast<size_t>(thisfile->mapsize) - off, PROT_READ,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+          != MAP_FAILED) {
+        map_fault = 1;
+        return;
+      }
+    }
+    signal(sig, SIG_DFL); /* The read is retried, and kills us */
+  }
+
+  /*
+   * The file has shrunk under the mapping: map what is left of it
+   * (if anything), forget where its end was, and redraw the screen,
+   * which may show the zeros map_bus put in.
+   */
+  static void map_check()
+  {
+    map_fault = 0;
+    if (thisfile == nullptr || thisfile->mapaddr == nullptr)
+      return;
+    ch_map();
+    thisfile->fsize = NULL_POSITION;
+    screen_trashed  = TRASHED;
+  }
+
+  /*
+   * Map the current file into memory.
+   * Only regular files are mapped, and only if --mmap is set;
+   * everything else (pipes, the help file, empty files) is buffered.
+   * Return true if the file is now mapped.
+   */
+  static bool ch_map()
+  {
+    static bool      handled = false;
+    struct sigaction sa;
+    struct stat      st;
+    void*            addr;
+
+    ch_unmap();
+    if (!less::Globals::use_mmap || !(thisfile->flags & CH_CANSEEK) || (thisfile->flags & (CH_HELPFILE | CH_NODATA))
+        || thisfile->nchain > 0)
+      return (false);
+    if (fstat(thisfile->file, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+      return (false);
+    if ((unsigned long long)st.st_size > SIZE_MAX)
+      return (false);
+    addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, thisfile->file, 0);
+    if (addr == MAP_FAILED)
+      return (false);
+    thisfile->mapaddr = (unsigned char*)addr;
+    thisfile->mapsize = st.st_size;
+    if (!handled) {
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = map_bus;
+      sa.sa_flags     = SA_SIGINFO;
+      sigemptyset(&sa.sa_mask);
+      handled = sigaction(SIGBUS, &sa, nullptr) == 0;
+    }
+    return (true);
+  }
+#endif
+
+  /*
+   * The read pointer has moved past the end of the mapping.
+   * If the file has grown since we mapped it, map it again.
+   * Return true if pos is now inside the mapping.
+   */
+  static bool ch_remap(position_t pos)
+  {
+#if HAVE_MMAP
+    if (filename::filesize(thisfile->file) > thisfile->mapsize)
+      ch_map();
+    return (thisfile->mapaddr != nullptr && pos < thisfile->mapsize);
+#else
+    return (false);
+#endif
+  }
+} // namespace
+
+/*
+ * Read-ahead.
+ *
+ * If --read-ahead is set, a background thread reads the blocks
+ * which follow (or, when moving backwards, precede) the block
+ * most recently missed by ch_get, so that by the time we get there
+ * the data is already in memory.  It is only used for seekable files
+ * which are read into buffers; it reads with pread, so it never
+ * disturbs thisfile->fpos.
+ *
+ * The thread never touches the buffer pool itself.  It reads into
+ * its own staging blocks, and ch_get copies a staged block into a
+ * buffer when it needs that block.  The number of staged blocks is
+ * limited to the --read-ahead window and to the -b buffer limit.
+ * Everything read ahead is discarded when the file is flushed or closed.
+ */
+namespace {
+  enum ra_state_t {
+    RA_QUEUED,  // Waiting for the thread to read it
+    RA_READING, // Being read by the thread
+    RA_READY    // Data is available
+  };
+
+  /*
+   * The data of a staged block follows the ra_block structure.
+   */
+  struct ra_block {
+    blocknum_t     block;
+    ra_state_t     state;
+    unsigned int   datasize;
+    unsigned char* data;
+  };
+
+  struct readahead {
+    std::mutex              lock;
+    std::condition_variable wake;        // Thread waits here for work
+    std::condition_variable done;        // Reader waits here for the thread
+    std::deque<blocknum_t>  queue;       // Blocks to be read, in order
+    std::vector<ra_block*>  blocks;      // Staged blocks
+    int                     file    = -1; // File being read ahead
+    unsigned int            blksize = 0;  // Its block size
+    unsigned long           gen     = 0;  // Bumped on cancel
+    bool                    busy    = false;
+    bool                    started = false;
+  };
+
+  /*
+   * Never destroyed: the thread may still be waiting on it at exit.
+   */
+  static readahead& ra = *new readahead;
+
+  /*
+   * Find a staged block.  Called with ra.lock held.
+   */
+  static ra_block* ra_find(blocknum_t block)
+  {
+    for (ra_block* rb : ra.blocks)
+      if (rb->block == block)
+        return (rb);
+    return (nullptr);
+  }
+
+  /*
+   * Remove a staged block and free it.  Called with ra.lock held.
+   */
+  static void ra_free(ra_block* rb)
+  {
+    ra.blocks.erase(std::find(ra.blocks.begin(), ra.blocks.end(), rb));
+    free(rb);
+  }
+
+  /*
+   * The read-ahead thread.
+   */
+  static void ra_thread()
+  {
+    std::unique_lock<std::mutex> lk(ra.lock);
+
+    for (;;) {
+      ra.wake.wait(lk, [] { return !ra.queue.empty(); });
+      blocknum_t block = ra.queue.front();
+      ra.queue.pop_front();
+      ra_block* rb = ra_find(block);
+      if (rb == nullptr || rb->state != RA_QUEUED)
+        continue;
+      int           f   = ra.file;
+      unsigned int  bs  = ra.blksize;
+      unsigned long gen = ra.gen;
+      rb->state         = RA_READING;
+      ra.busy           = true;
+      lk.unlock();
+
+      ssize_t n = pread(f, rb->data, bs, block * bs);
+
+      lk.lock();
+      ra.busy = false;
+      if (gen == ra.gen) {
+        rb->datasize = (n > 0) ? static_cast<unsigned int>(n) : 0;
+        rb->state    = RA_READY;
+      }
+      ra.done.notify_all();
+    }
+  }
+
+  /*
+   * Start the read-ahead thread, if it isn't running yet.
+   * Signals are blocked in the thread, so they are always
+   * delivered to the main thread (see os::iread).
+   */
+  static bool ra_start()
+  {
+    sigset_t all;
+    sigset_t old;
+
+    if (ra.started)
+      return (true);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    try {
+      std::thread(ra_thread).detach();
+      ra.started = true;
+    } catch (const std::system_error&) {
+      less::Globals::read_ahead = 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    return (ra.started);
+  }
+
+  /*
+   * Discard everything that has been read ahead,
+   * waiting for any read in progress to finish.
+   */
+  static void ra_cancel()
+  {
+    std::unique_lock<std::mutex> lk(ra.lock);
+
+    ra.gen++;
+    ra.queue.clear();
+    ra.done.wait(lk, [] { return !ra.busy; });
+    for (ra_block* rb : ra.blocks)
+      free(rb);
+    ra.blocks.clear();
+    ra.file = -1;
+  }
+
+  /*
+   * If the read-ahead thread has (or is reading) the current block,
+   * copy it into bp.  Return true if bp now holds the block.
+   */
+  static bool ra_take(struct buf* bp)
+  {
+    if (!ra.started)
+      return (false);
+
+    std::unique_lock<std::mutex> lk(ra.lock);
+    ra_block*                    rb;
+
+    if (ra.file != thisfile->file || (rb = ra_find(thisfile->block)) == nullptr)
+      return (false);
+    if (rb->state == RA_QUEUED) {
+      /*
+       * Not started yet: it's quicker to read it ourselves.
+       */
+      ra_free(rb);
+      return (false);
+    }
+    ra.done.wait(lk, [rb] { return rb->state == RA_READY; });
+    memcpy(bp->data, rb->data, rb->datasize);
+    bp->datasize = rb->datasize;
+    ra_free(rb);
+    return (bp->datasize > 0);
+  }
+
+  /*
+   * Queue the blocks ahead of the current block for reading,
+   * in the direction we're moving through the file.
+   */
+  static void ra_schedule()
+  {
+    int        window = less::Globals::read_ahead;
+    blocknum_t block;
+    blocknum_t lo;
+    blocknum_t hi;
+    int        i;
+
+    if (window <= 0 || !(thisfile->flags & CH_CANSEEK) || (thisfile->flags & (CH_HELPFILE | CH_NODATA))
+        || thisfile->mapaddr != nullptr || thisfile->nchain > 0)
+      return;
+    if (thisfile->maxbufs >= 0 && window > thisfile->maxbufs)
+      window = thisfile->maxbufs;
+    if (ra.file != thisfile->file)
+      ra_cancel();
+    if (!ra_start())
+      return;
+
+    if (ra_dir > 0) {
+      lo = thisfile->block + 1;
+      hi = thisfile->block + window;
+    } else {
+      lo = thisfile->block - window;
+      hi = thisfile->block - 1;
+    }
+    if (lo < 0)
+      lo = 0;
+    if (thisfile->fsize != NULL_POSITION && hi > (thisfile->fsize - 1) / thisfile->bs->blksize)
+      hi = (thisfile->fsize - 1) / thisfile->bs->blksize;
+
+    std::lock_guard<std::mutex> lk(ra.lock);
+    ra.file    = thisfile->file;
+    ra.blksize = thisfile->bs->blksize;
+
+    /*
+     * Drop staged blocks which have fallen out of the window.
+     * A block being read is left alone; it's dropped later.
+     */
+    for (i = static_cast<int>(ra.blocks.size()) - 1; i >= 0; i--) {
+      ra_block* rb = ra.blocks[i];
+      if ((rb->block < lo || rb->block > hi) && rb->state != RA_READING)
+        ra_free(rb);
+    }
+
+    for (i = 0; i < window; i++) {
+      block = (ra_dir > 0) ? lo + i : hi - i;
+      if (block < lo || block > hi)
+        break;
+      if (static_cast<int>(ra.blocks.size()) >= window)
+        break;
+      if (buffered(block) || ra_find(block) != nullptr)
+        continue;
+      ra_block* rb = static_cast<ra_block*>(malloc(sizeof(ra_block) + thisfile->bs->blksize));
+      if (rb == nullptr)
+        break;
+      rb->data     = (unsigned char*)(rb + 1);
+      rb->block    = block;
+      rb->state    = RA_QUEUED;
+      rb->datasize = 0;
+      ra.blocks.push_back(rb);
+      ra.queue.push_back(block);
+    }
+    ra.wake.notify_one();
+  }
+} // namespace
+
+/*
+ * The block index and the LRU list.
+ */
+namespace {
+  /*
+   * Hash a block number to its home position in the index.
+   * Blocks are mostly used in runs, so scatter them (Fibonacci hashing)
+   * rather than letting a run fill a stretch of the table.
+   */
+  static inline int index_hash(const struct blockset* bs, blocknum_t block)
+  {
+    return (static_cast<int>((static_cast<uint64_t>(block) * 0x9E3779B97F4A7C15ull) >> (64 - bs->ibits)));
+  }
+
+  /*
+   * Find the slot of the buffer holding a block, or -1.
+   */
+  static int index_find(struct blockset* bs, blocknum_t block)
+  {
+    int mask = bs->nindex - 1;
+    int i;
+
+    for (i = index_hash(bs, block);; i = (i + 1) & mask) {
+      if (bs->index[i].block == block)
+        return (bs->index[i].slot);
+      if (bs->index[i].block < 0)
+        return (-1);
+    }
+  }
+
+  /*
+   * Allocate an empty index with 2^ibits entries.
+   */
+  static void index_alloc(struct blockset* bs, int ibits)
+  {
+    bs->ibits  = ibits;
+    bs->nindex = 1 << ibits;
+    bs->index  = (struct bindex*)utils::ecalloc(bs->nindex, sizeof(struct bindex));
+    index_clear(bs);
+  }
+
+  /*
+   * Remove all entries from the index.
+   */
+  static void index_clear(struct blockset* bs)
+  {
+    for (int i = 0; i < bs->nindex; i++)
+      bs->index[i].block = -1;
+  }
+
+  /*
+   * Record that a block is in the buffer in a slot.
+   * The index is kept at most half full, so probes stay short.
+   */
+  static void index_insert(struct blockset* bs, blocknum_t block, int slot)
+  {
+    int mask;
+    int i;
+
+    if (2 * bs->nbufs > bs->nindex) {
+      /*
+       * Grow the index and put the buffers back in it.
+       */
+      int ibits = bs->ibits;
+
+      while ((1 << ibits) < 2 * bs->nbufs)
+        ibits++;
+      free(bs->index);
+      index_alloc(bs, ibits);
+      for (int s = 0; s < bs->nbufs; s++)
+        if (bs->bufs[s]->block >= 0 && bs->bufs[s]->block != block)
+          index_insert(bs, bs->bufs[s]->block, s);
+    }
+    mask = bs->nindex - 1;
+    for (i = index_hash(bs, block); bs->index[i].block >= 0; i = (i + 1) & mask)
+      ;
+    bs->index[i].block = block;
+    bs->index[i].slot  = slot;
+  }
+
+  /*
+   * Remove a block from the index.  Later entries of the same run
+   * are moved back, so that no lookup runs into a hole.
+   */
+  static void index_remove(struct blockset* bs, blocknum_t block)
+  {
+    int mask = bs->nindex - 1;
+    int i;
+    int j;
+
+    for (i = index_hash(bs, block); bs->index[i].block != block; i = (i + 1) & mask)
+      if (bs->index[i].block < 0)
+        return;
+    for (j = (i + 1) & mask; bs->index[j].block >= 0; j = (j + 1) & mask) {
+      int home = index_hash(bs, bs->index[j].block);
+      /*
+       * Entry j may move to the hole at i
+       * unless its home lies cyclically in (i, j].
+       */
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        bs->index[i] = bs->index[j];
+        i            = j;
+      }
+    }
+    bs->index[i].block = -1;
+  }
+
+  /*
+   * Take a slot out of the LRU list.
+   */
+  static void lru_unlink(struct blockset* bs, int slot)
+  {
+    struct lrulink* l = &bs->lru[slot];
+
+    if (l->prev >= 0)
+      bs->lru[l->prev].next = l->next;
+    else
+      bs->head = l->next;
+    if (l->next >= 0)
+      bs->lru[l->next].prev = l->prev;
+    else
+      bs->tail = l->prev;
+  }
+
+  /*
+   * Put a slot at the head (most recently used end) of the LRU list.
+   */
+  static void lru_push_head(struct blockset* bs, int slot)
+  {
+    bs->lru[slot].prev = -1;
+    bs->lru[slot].next = bs->head;
+    if (bs->head >= 0)
+      bs->lru[bs->head].prev = slot;
+    else
+      bs->tail = slot;
+    bs->head = slot;
+  }
+
+  /*
+   * Put a slot at the tail (least recently used end) of the LRU list.
+   */
+  static void lru_push_tail(struct blockset* bs, int slot)
+  {
+    bs->lru[slot].next = -1;
+    bs->lru[slot].prev = bs->tail;
+    if (bs->tail >= 0)
+      bs->lru[bs->tail].next = slot;
+    else
+      bs->head = slot;
+    bs->tail = slot;
+  }
+} // namespace
+
+/*
+ * Slabs.
+ *
+ * Rather than allocating each buffer on its own, buffers are carved
+ * from slabs of many buffers, mapped straight from the system.
+ * Each blockset has its own slabs, which all go at once when its
+ * buffers are deleted.  Slabs start small and double in size up to
+ * SLAB_SIZE, so that small files don't reserve much memory.
+ * A buffer given back (by the block cache) goes on the blockset's
+ * free list, and its data pages are returned to the system.
+ *
+ * With --huge-pages, slabs are made a multiple of the huge page size
+ * and aligned to it, and the system is asked to back them with
+ * transparent huge pages, which saves TLB misses when many buffers
+ * are in use.
+ */
+const int    MIN_SLABBUFS = 4;
+const size_t SLAB_SIZE    = 2 * 1024 * 1024; /* Also the huge page size */
+
+namespace {
+  static ch::allocstats astat; /* Allocation counters */
+
+  static size_t page_size()
+  {
+    static size_t pgsize = 0;
+
+    if (pgsize == 0) {
+      long n = sysconf(_SC_PAGESIZE);
+      pgsize = (n > 0) ? static_cast<size_t>(n) : 4096;
+    }
+    return (pgsize);
+  }
+
+  static size_t round_up(size_t n, size_t to)
+  {
+    return ((n + to - 1) / to * to);
+  }
+
+  /*
+   * Get size bytes of zeroed memory for a slab.
+   */
+  static void* slab_map(size_t size, bool huge)
+  {
+#if HAVE_MMAP
+    void* p;
+
+    if (!huge) {
+      p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      return ((p == MAP_FAILED) ? nullptr : p);
+    }
+    /*
+     * Map an extra huge page and trim the ends,
+     * so that the slab is aligned to a huge page.
+     */
+    p = mmap(nullptr, size + SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return (nullptr);
+    uintptr_t start  = reinterpret_cast<uintptr_t>(p);
+    uintptr_t astart = round_up(start, SLAB_SIZE);
+    if (astart > start)
+      munmap(p, astart - start);
+    munmap(reinterpret_cast<void*>(astart + size), start + SLAB_SIZE - astart);
+#ifdef MADV_HUGEPAGE
+    madvise(reinterpret_cast<void*>(astart), size, MADV_HUGEPAGE);
+#endif
+    return (reinterpret_cast<void*>(astart));
+#else
+    (void)huge;
+    return (calloc(1, size));
+#endif
+  }
+
+  static void slab_unmap(struct slab* sp)
+  {
+#if HAVE_MMAP
+    munmap(sp, sp->size);
+#else
+    free(sp);
+#endif
+  }
+
+  /*
+   * Add a slab to a blockset, with its buffers on the free list.
+   * Don't make more than maxb buffers in all (if maxb >= 0).
+   */
+  static bool slab_new(struct blockset* bs, int maxb)
+  {
+    int          n = bs->slabbufs;
+    bool         huge;
+    size_t       hdrsize;
+    size_t       size;
+    struct slab* sp;
+
+    if (maxb > bs->nbufs && n > maxb - bs->nbufs)
+      n = maxb - bs->nbufs;
+    if (n < 1)
+      n = 1;
+    hdrsize = round_up(sizeof(struct slab) + n * sizeof(struct buf), page_size());
+    size    = hdrsize + static_cast<size_t>(n) * bs->blksize;
+    huge    = less::Globals::huge_pages && size >= SLAB_SIZE;
+    if (huge) {
+      /*
+       * Fill out the last huge page with buffers.
+       */
+      size = round_up(size, SLAB_SIZE);
+      for (n = static_cast<int>(size / bs->blksize);; n--) {
+        hdrsize = round_up(sizeof(struct slab) + n * sizeof(struct buf), page_size());
+        if (hdrsize + static_cast<size_t>(n) * bs->blksize <= size)
+          break;
+      }
+    }
+
+    sp = (struct slab*)slab_map(size, huge);
+    if (sp == nullptr)
+      return (false);
+    sp->size  = size;
+    sp->huge  = huge;
+    sp->next  = bs->slabs;
+    bs->slabs = sp;
+
+    struct buf*    bufs = (struct buf*)(sp + 1);
+    unsigned char* data = (unsigned char*)sp + hdrsize;
+    for (int i = n - 1; i >= 0; i--) {
+      bufs[i].data     = data + static_cast<size_t>(i) * bs->blksize;
+      bufs[i].nextfree = bs->freebufs;
+      bs->freebufs     = &bufs[i];
+    }
+    if (static_cast<size_t>(bs->slabbufs) * bs->blksize < SLAB_SIZE)
+      bs->slabbufs *= 2;
+
+    astat.slabs++;
+    if (huge)
+      astat.hugeslabs++;
+    astat.slaballocs++;
+    astat.slabbytes += size;
+    astat.freebufs += n;
+    return (true);
+  }
+
+  /*
+   * Get a buffer for a blockset.
+   */
+  static struct buf* buf_alloc(struct blockset* bs, int maxb)
+  {
+    struct buf* bp;
+
+    if (bs->freebufs == nullptr && !slab_new(bs, maxb))
+      return (nullptr);
+    bp           = bs->freebufs;
+    bs->freebufs = bp->nextfree;
+    astat.freebufs--;
+    astat.bufs++;
+    return (bp);
+  }
+
+  /*
+   * Give back a buffer of a blockset.
+   * Its slab stays, but the memory for its data is released.
+   */
+  static void buf_free(struct blockset* bs, struct buf* bp)
+  {
+#if HAVE_MMAP && defined(MADV_DONTNEED)
+    madvise(bp->data, bs->blksize, MADV_DONTNEED);
+#endif
+    bp->nextfree = bs->freebufs;
+    bs->freebufs = bp;
+    astat.bufs--;
+    astat.freebufs++;
+  }
+
+  /*
+   * Free all the slabs of a blockset, and so all its buffers.
+   */
+  static void slab_freeall(struct blockset* bs)
+  {
+    struct slab* sp;
+
+    astat.bufs -= bs->nbufs;
+    for (struct buf* bp = bs->freebufs; bp != nullptr; bp = bp->nextfree)
+      astat.freebufs--;
+    bs->freebufs = nullptr;
+    while ((sp = bs->slabs) != nullptr) {
+      bs->slabs = sp->next;
+      astat.slabs--;
+      if (sp->huge)
+        astat.hugeslabs--;
+      astat.slabfrees++;
+      astat.slabbytes -= sp->size;
+      slab_unmap(sp);
+    }
+    bs->slabbufs = MIN_SLABBUFS;
+  }
+} // namespace
+
+/*
+ * Allocate a new, empty blockset.
+ */
+static struct blockset* bs_new(unsigned int blksize)
+{
+  struct blockset* bs;
+  int              ibits;
+
+  bs = (struct blockset*)utils::ecalloc(1, sizeof(struct blockset));
+  bs->bufs      = nullptr;
+  bs->lru       = nullptr;
+  bs->nslots    = 0;
+  bs->head      = -1;
+  bs->tail      = -1;
+  bs->blksize   = blksize;
+  bs->nbufs     = 0;
+  bs->slabs     = nullptr;
+  bs->freebufs  = nullptr;
+  bs->slabbufs  = MIN_SLABBUFS;
+  bs->users     = 0;
+  bs->cached    = false;
+  bs->spill     = false;
+  bs->compress  = false;
+  bs->spillfd   = -1;
+  bs->spillsize = nullptr;
+  bs->zblocks   = nullptr;
+  bs->nspill    = 0;
+  bs->spillend  = 0;
+  for (ibits = 0; (1 << ibits) < MIN_INDEX; ibits++)
+    ;
+  index_alloc(bs, ibits);
+  return (bs);
+}
+
+/*
+ * Delete all buffers in a blockset.
+ */
+static void bs_delbufs(struct blockset* bs)
+{
+  slab_freeall(bs);
+  if (bs->cached)
+    cache_used -= static_cast<position_t>(bs->nbufs) * bs->blksize;
+  bs->nbufs = 0;
+  bs->head  = -1;
+  bs->tail  = -1;
+  index_clear(bs);
+}
+
+/*
+ * Free a blockset, with all its buffers, its spill file
+ * and its compressed blocks.
+ */
+static void bs_delete(struct blockset* bs)
+{
+  bs_delbufs(bs);
+  if (bs->spillfd >= 0)
+    ::close(bs->spillfd);
+  if (bs->zblocks != nullptr)
+    for (blocknum_t b = 0; b < bs->nspill; b++)
+      zfree(bs, b);
+  free(bs->zblocks);
+  free(bs->spillsize);
+  free(bs->index);
+  free(bs->lru);
+  free(bs->bufs);
+  free(bs);
+}
+
+/*
+ * The block cache.
+ *
+ * Blocksets of regular files stay in the block cache after the file
+ * is closed, so that going back to a file we've recently viewed
+ * (e.g. with :n and :p) doesn't read it all again.
+ * A blockset is found again by the device and inode of its file;
+ * if the file's size or modification time has changed since, its
+ * buffers are discarded.
+ *
+ * All the buffers in the cache share one memory budget, set by
+ * --cache-size.  When a new buffer would exceed it, buffers are taken
+ * from the least recently viewed file first, and from its least
+ * recently used blocks first.  Each file is also still limited by -b.
+ */
+namespace {
+  static struct blockset* cache_list = nullptr; /* Most recently used first */
+
+  static void cache_unlink(struct blockset* bs)
+  {
+    if (bs->prev != nullptr)
+      bs->prev->next = bs->next;
+    else
+      cache_list = bs->next;
+    if (bs->next != nullptr)
+      bs->next->prev = bs->prev;
+    bs->next = bs->prev = nullptr;
+  }
+
+  static void cache_link_head(struct blockset* bs)
+  {
+    bs->prev = nullptr;
+    bs->next = cache_list;
+    if (cache_list != nullptr)
+      cache_list->prev = bs;
+    cache_list = bs;
+  }
+
+  /*
+   * Free a blockset which nobody is using.
+   */
+  static void bs_free(struct blockset* bs)
+  {
+    if (bs->cached)
+      cache_unlink(bs);
+    bs_delete(bs);
+  }
 
   /*
-   * Seek to a known position: the beginning of the file.
+   * Free the least recently used buffer of a blockset.
    */
-  thisfile->fpos = 0;
-  // log("flush-> fpos = " + std::to_string(thisfile->fpos));
-  thisfile->block  = 0; /* thisfile->fpos / LBUFSIZE; */
-  thisfile->offset = 0; /* thisfile->fpos % LBUFSIZE; */
+  static void bs_evict(struct blockset* bs)
+  {
+    int slot = bs->tail;
+    int last = bs->nbufs - 1;
+
+    lru_unlink(bs, slot);
+    if (bs->bufs[slot]->block >= 0)
+      index_remove(bs, bs->bufs[slot]->block);
+    buf_free(bs, bs->bufs[slot]);
+    if (slot != last) {
+      /*
+       * Move the last slot into the freed one, to keep slots dense.
+       */
+      struct buf*     bp = bs->bufs[last];
+      struct lrulink* l  = &bs->lru[slot];
+
+      bs->bufs[slot] = bp;
+      *l             = bs->lru[last];
+      if (l->prev >= 0)
+        bs->lru[l->prev].next = slot;
+      else
+        bs->head = slot;
+      if (l->next >= 0)
+        bs->lru[l->next].prev = slot;
+      else
+        bs->tail = slot;
+      if (bp->block >= 0) {
+        index_remove(bs, bp->block);
+        index_insert(bs, bp->block, slot);
+      }
+    }
+    bs->nbufs--;
+    cache_used -= bs->blksize;
+  }
 
-#if 1
   /*
-   * This is a kludge to workaround a Linux kernel bug: files in
-   * /proc have a size of 0 according to fstat() but have readable
-   * data.  They are sometimes, but not always, seekable.
-   * Force them to be non-seekable here.
+   * Free cached buffers until there is room for need more bytes.
    */
-  if (thisfile->fsize == 0) {
-    thisfile->fsize = NULL_POSITION;
-    thisfile->flags &= ~CH_CANSEEK;
+  static void cache_trim(unsigned int need)
+  {
+    struct blockset* bs;
+    position_t       budget;
+
+    if (less::Globals::cache_size < 0)
+      return;
+    budget = static_cast<position_t>(less::Globals::cache_size) * 1024;
+    while (cache_used + need > budget) {
+      /*
+       * Find the least recently used blockset which has buffers.
+       */
+      for (bs = cache_list; bs != nullptr && bs->next != nullptr; bs = bs->next)
+        ;
+      while (bs != nullptr && bs->nbufs == 0)
+        bs = bs->prev;
+      if (bs == nullptr)
+        break;
+      bs_evict(bs);
+      if (bs->nbufs == 0 && bs->users == 0)
+        bs_free(bs);
+    }
   }
-#endif
 
-  if (lseek(thisfile->file, (off_t)0, SEEK_SET) == BAD_LSEEK) {
-    /*
-     * Warning only; even if the seek fails for some reason,
-     * there's a good chance we're at the beginning anyway.
-     * {{ I think this is bogus reasoning. }}
-     */
-    output::error((char*)"seek output::error to 0", NULL_PARG);
+  /*
+   * Remember the identity of a cached blockset's file.
+   */
+  static void cache_stamp(struct blockset* bs, int f)
+  {
+#if HAVE_STAT_INO
+    struct stat st;
+
+    if (fstat(f, &st) < 0)
+      return;
+    bs->dev   = st.st_dev;
+    bs->ino   = st.st_ino;
+    bs->size  = st.st_size;
+    bs->mtime = st.st_mtim;
+#endif
   }
 
-  chDebug("flush");
-  chDebug(to_string(thisfile));
-}
+  /*
+   * Find (or create) the blockset for a file.
+   * *validp is set if the blockset's buffers still hold the
+   * current contents of the file.
+   */
+  static struct blockset* cache_attach(int f, int flags, unsigned int blksize, bool* validp)
+  {
+    struct blockset* bs = nullptr;
+
+    *validp = false;
+#if HAVE_STAT_INO
+    struct stat st;
+
+    if ((flags & CH_CANSEEK) && !(flags & (CH_HELPFILE | CH_NODATA | CH_POPENED)) && less::Globals::cache_size != 0
+        && fstat(f, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      for (bs = cache_list; bs != nullptr; bs = bs->next)
+        if (bs->dev == st.st_dev && bs->ino == st.st_ino)
+          break;
+      if (bs != nullptr && bs->blksize != blksize && bs->users == 0) {
+        /*
+         * Block size has changed: start again.
+         */
+        bs_free(bs);
+        bs = nullptr;
+      }
+      if (bs != nullptr) {
+        *validp = (bs->size == st.st_size && bs->mtime.tv_sec == st.st_mtim.tv_sec
+            && bs->mtime.tv_nsec == st.st_mtim.tv_nsec);
+        cache_unlink(bs);
+      } else {
+        bs         = bs_new(blksize);
+        bs->cached = true;
+        cache_stamp(bs, f);
+      }
+      cache_link_head(bs);
+      bs->users++;
+      return (bs);
+    }
+#endif
+    bs        = bs_new(blksize);
+    bs->spill    = (less::Globals::spill || less::Globals::compress)
+        && !(flags & (CH_CANSEEK | CH_HELPFILE | CH_NODATA));
+    bs->compress = bs->spill && less::Globals::compress;
+    bs->users++;
+    return (bs);
+  }
+} // namespace
 
+/*
+ * The log file writer.
+ *
+ * Data read from a pipe is written to the log file (-o) by a background
+ * thread, so that a slow log file doesn't slow down reading.  ch_get
+ * appends what it reads to a pending batch, and the thread takes the
+ * whole batch and writes it with as few writes as it can.  If the
+ * pending batch and the one being written come to LOG_PENDING bytes
+ * or more, ch_get waits for the thread to catch up, so no more than
+ * LOG_PENDING bytes, plus what was read last, are ever outstanding.
+ * If the thread can't be started, we write the log file ourselves.
+ */
 namespace {
+  struct logwriter {
+    std::mutex                 lock;
+    std::condition_variable    wake;         // Thread waits here for data
+    std::condition_variable    done;         // Reader waits here for the thread
+    std::vector<unsigned char> pending;      // Data waiting to be written
+    size_t                     writing = 0;  // Size of the batch being written
+    int                        file    = -1; // Log file being written
+    bool                       started = false;
+    bool                       failed  = false;
+  };
+
   /*
-   * Allocate a new buffer.
-   * The buffer is added to the tail of the buffer chain.
+   * Never destroyed, like the read-ahead state.
    */
-  static int ch_addbuf()
+  static logwriter& lw = *new logwriter;
+
+  static void log_write(int f, const unsigned char* data, size_t len)
   {
-    struct buf*     bp;
-    struct bufnode* bn;
+    while (len > 0) {
+      ssize_t n = write(f, data, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      data += n;
+      len -= n;
+    }
+  }
 
-    /*
-     * Allocate and initialize a new buffer and link it
-     * onto the tail of the buffer list.
-     */
-    bp = (struct buf*)calloc(1, sizeof(struct buf));
-    if (bp == nullptr)
-      return (1);
-    thisfile->nbufs++;
-    bp->block = -1;
-    bn        = &bp->node;
+  /*
+   * The log writer thread.
+   */
+  static void log_thread()
+  {
+    std::unique_lock<std::mutex> lk(lw.lock);
+    std::vector<unsigned char>   batch;
+
+    for (;;) {
+      lw.wake.wait(lk, [] { return !lw.pending.empty(); });
+      batch.swap(lw.pending);
+      int f      = lw.file;
+      lw.writing = batch.size();
+      lk.unlock();
+
+      log_write(f, batch.data(), batch.size());
+      batch.clear();
+
+      lk.lock();
+      lw.writing = 0;
+      lw.done.notify_all();
+    }
+  }
 
-    BUF_INS_TAIL(bn);
-    BUF_HASH_INS(bn, 0);
+  /*
+   * Start the log writer thread, if it isn't running yet.
+   * Signals are blocked in the thread, as for read-ahead.
+   */
+  static bool log_start()
+  {
+    sigset_t all;
+    sigset_t old;
+
+    if (lw.started || lw.failed)
+      return (lw.started);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    try {
+      std::thread(log_thread).detach();
+      lw.started = true;
+    } catch (const std::system_error&) {
+      lw.failed = true;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    return (lw.started);
+  }
 
-    chDebug("ch_addbuf add buff:");
-    chDebug(to_string(bp));
-    chDebug("------------------------ thisfile now ------------------------\n");
-    chDebug(to_string(thisfile));
-    chDebug("--------------------------------------------------------------\n");
-    return (0);
+  /*
+   * Write data to the log file (eventually).
+   */
+  static void log_put(const unsigned char* data, size_t len)
+  {
+    if (!log_start()) {
+      log_write(less::Globals::logfile, data, len);
+      return;
+    }
+
+    std::unique_lock<std::mutex> lk(lw.lock);
+
+    lw.done.wait(lk, [] { return lw.pending.size() + lw.writing < LOG_PENDING; });
+    lw.file = less::Globals::logfile;
+    lw.pending.insert(lw.pending.end(), data, data + len);
+    lw.wake.notify_one();
+  }
+
+  /*
+   * Wait until everything has been written to the log file.
+   */
+  static void log_flush()
+  {
+    if (!lw.started)
+      return;
+
+    std::unique_lock<std::mutex> lk(lw.lock);
+
+    lw.done.wait(lk, [] { return lw.pending.empty() && lw.writing == 0; });
+    lw.file = -1;
   }
 } // namespace
 
 /*
+ * Spilling.
  *
+ * Data read from a pipe can't be read again, so normally (with autobuf)
+ * every block of a pipe is kept in memory, and if the buffers are
+ * limited, blocks which are reused are lost.  If --spill is set, a pipe
+ * is limited to its -b buffers instead, and when a buffer is reused its
+ * block is first written to a spill file, to be read back when needed.
+ * The spill file is created in --spill-dir (or $TMPDIR, or /tmp) and
+ * unlinked straight away, so it goes away when we exit.
+ * Spilled block b is at offset b * blksize in the spill file.
+ *
+ * With --compress, blocks are instead compressed (see lz.cpp) and
+ * kept in memory, which for text is usually a fifth of the size or less.
  */
-static void init_hashtbl()
-{
-  int h;
+namespace {
+  static ch::zstats zstat;                 /* Compression counters */
+  static std::vector<unsigned char> zbuf; /* Scratch space for compressing */
+
+  /*
+   * Has a block of the current file been spilled?
+   */
+  static bool spilled(blocknum_t block)
+  {
+    struct blockset* bs = thisfile->bs;
 
-  for (h = 0; h < BUFHASH_SIZE; h++) {
-    thisfile->hashtbl[h].hnext = END_OF_HCHAIN(h);
-    thisfile->hashtbl[h].hprev = END_OF_HCHAIN(h);
+    return (block >= 0 && block < bs->nspill && bs->spillsize[block] > 0);
   }
-}
 
-/*
- * Delete all buffers for this file.
- */
-static void ch_delbufs()
-{
-  struct bufnode* bn;
+  /*
+   * Something has gone wrong with the spill file: stop spilling.
+   * Blocks which have been spilled can still be read back.
+   */
+  static void spill_fail(const char* msg)
+  {
+    parg_t parg;
 
-  while (thisfile->buflist.next != END_OF_CHAIN) {
-    // #ifndef CLANGTIDY
-    //  Clang-tidy has problems with this code
-    bn = thisfile->buflist.next;
-    BUF_RM(bn);
-    free(bufnode_buf(bn));
-    // #endif
+    parg.p_string = (char*)msg;
+    output::error((char*)"%s; input from the pipe may be lost", parg);
+    thisfile->bs->spill = false;
   }
-  thisfile->nbufs = 0;
-  init_hashtbl();
 
-  chDebug("ch_delbufs");
-  chDebug(to_string(thisfile));
-}
+  /*
+   * Create the spill file for the current file.
+   */
+  static bool spill_open()
+  {
+    const char* dir = less::Globals::spill_dir;
+    std::string path;
+
+    if (dir == nullptr || *dir == '\0')
+      dir = getenv("TMPDIR");
+    if (dir == nullptr || *dir == '\0')
+      dir = "/tmp";
+    path = std::string(dir) + "/eless.XXXXXX";
+    std::vector<char> tmpl(path.begin(), path.end());
+    tmpl.push_back('\0');
+    thisfile->bs->spillfd = mkstemp(tmpl.data());
+    if (thisfile->bs->spillfd < 0) {
+      spill_fail("Cannot create spill file");
+      return (false);
+    }
+    unlink(tmpl.data());
+    return (true);
+  }
+
+  /*
+   * Make room for block in the spill tables of the current file.
+   */
+  static bool spill_grow(blocknum_t block)
+  {
+    struct blockset* bs     = thisfile->bs;
+    blocknum_t       nspill = (bs->nspill > 0) ? bs->nspill : 64;
+    unsigned int*    sizes;
+    struct zblock*   zb;
+
+    if (block < bs->nspill)
+      return (true);
+    while (nspill <= block)
+      nspill *= 2;
+    sizes = (unsigned int*)realloc(bs->spillsize, nspill * sizeof(unsigned int));
+    if (sizes == nullptr)
+      return (false);
+    memset(&sizes[bs->nspill], 0, (nspill - bs->nspill) * sizeof(unsigned int));
+    bs->spillsize = sizes;
+    if (bs->compress) {
+      zb = (struct zblock*)realloc(bs->zblocks, nspill * sizeof(struct zblock));
+      if (zb == nullptr)
+        return (false);
+      memset(&zb[bs->nspill], 0, (nspill - bs->nspill) * sizeof(struct zblock));
+      bs->zblocks = zb;
+    }
+    bs->nspill = nspill;
+    return (true);
+  }
+
+  /*
+   * Free a compressed block.
+   */
+  static void zfree(struct blockset* bs, blocknum_t block)
+  {
+    struct zblock* zb = &bs->zblocks[block];
+
+    if (zb->data == nullptr)
+      return;
+    zstat.held--;
+    zstat.rawbytes -= bs->spillsize[block];
+    zstat.zbytes -= zb->size;
+    free(zb->data);
+    zb->data = nullptr;
+  }
+
+  /*
+   * Compress the block in bp and keep it in memory.
+   */
+  static bool zput(struct buf* bp)
+  {
+    struct blockset* bs = thisfile->bs;
+    struct zblock*   zb = &bs->zblocks[bp->block];
+    unsigned char*   data;
+    int              n;
+
+    zbuf.resize(lz::bound(bs->blksize));
+    n = lz::compress(bp->data, bp->datasize, zbuf.data(), static_cast<int>(zbuf.size()));
+    bool raw = (n <= 0 || static_cast<unsigned int>(n) >= bp->datasize);
+    if (raw)
+      n = bp->datasize;
+    data = (unsigned char*)malloc(n);
+    if (data == nullptr)
+      return (false);
+    memcpy(data, raw ? bp->data : zbuf.data(), n);
+
+    zfree(bs, bp->block);
+    zb->data = data;
+    zb->size = n;
+    zb->raw  = raw;
+    zstat.compressed++;
+    zstat.held++;
+    zstat.rawbytes += bp->datasize;
+    zstat.zbytes += n;
+    return (true);
+  }
+
+  /*
+   * Decompress a block of the current file into data.
+   * Return the number of bytes, or -1 on error.
+   */
+  static int zget(blocknum_t block, unsigned char* data)
+  {
+    struct blockset* bs = thisfile->bs;
+    struct zblock*   zb = &bs->zblocks[block];
+    int              n;
+
+    if (zb->raw) {
+      memcpy(data, zb->data, zb->size);
+      n = zb->size;
+    } else
+      n = lz::decompress(zb->data, zb->size, data, bs->blksize);
+    if (n != static_cast<int>(bs->spillsize[block]))
+      return (-1);
+    zstat.decompressed++;
+    return (n);
+  }
+
+  /*
+   * A buffer of the current file is about to be reused:
+   * write its block to the spill file, or compress it.
+   */
+  static void spill_put(struct buf* bp)
+  {
+    struct blockset* bs = thisfile->bs;
+    unsigned int     done;
+    ssize_t          n;
+
+    if (!bs->spill || bp->block < 0 || bp->datasize == 0)
+      return;
+    if (spilled(bp->block) && bs->spillsize[bp->block] == bp->datasize)
+      /*
+       * Already there (pipe data never changes).
+       */
+      return;
+    if (!bs->compress && bs->spillfd < 0 && !spill_open())
+      return;
+    if (!spill_grow(bp->block)) {
+      spill_fail("Cannot allocate memory for spill file");
+      return;
+    }
+
+    if (bs->compress) {
+      if (!zput(bp)) {
+        spill_fail("Cannot allocate memory for compressed block");
+        return;
+      }
+    } else {
+      for (done = 0; done < bp->datasize; done += n) {
+        n = pwrite(bs->spillfd, &bp->data[done], bp->datasize - done,
+            (bp->block * bs->blksize) + done);
+        if (n <= 0) {
+          bs->spillsize[bp->block] = 0;
+          spill_fail("Cannot write spill file");
+          return;
+        }
+      }
+    }
+    bs->spillsize[bp->block] = bp->datasize;
+    if (bp->block * bs->blksize + bp->datasize > bs->spillend)
+      bs->spillend = bp->block * bs->blksize + bp->datasize;
+  }
+
+  /*
+   * Read a spilled block of the current file into data.
+   * Return the number of bytes read, or -1 on error.
+   */
+  static int spill_read(blocknum_t block, unsigned char* data)
+  {
+    struct blockset* bs = thisfile->bs;
+    unsigned int     size;
+    unsigned int     done;
+    ssize_t          n;
+
+    if (!spilled(block))
+      return (-1);
+    if (bs->compress)
+      return (zget(block, data));
+    size = bs->spillsize[block];
+    for (done = 0; done < size; done += n) {
+      n = pread(bs->spillfd, &data[done], size - done, (block * bs->blksize) + done);
+      if (n <= 0)
+        return (-1);
+    }
+    return (static_cast<int>(size));
+  }
+
+  /*
+   * If the block wanted for bp has been spilled, read it back.
+   * Return true if bp now holds the block.
+   */
+  static bool spill_get(struct buf* bp)
+  {
+    int n = spill_read(bp->block, bp->data);
+
+    if (n <= 0)
+      return (false);
+    bp->datasize = n;
+    return (true);
+  }
+} // namespace
 
 /*
  * Is it possible to seek on a file descriptor?
@@ -917,6 +3032,50 @@ int seekable(int f)
   return (lseek(f, (off_t)1, SEEK_SET) != BAD_LSEEK);
 }
 
+/*
+ * Choose the block size for a new file.
+ * --block-size sets it explicitly; otherwise it depends on the
+ * kind of file: pipes use PIPE_BLKSIZE, and big seekable files use
+ * bigger blocks, so that they are covered by about AUTO_NBLOCKS blocks.
+ * A block size chosen for a big file (or a pipe with -B) is kept small
+ * enough that MIN_BIGBUFS blocks fit in the -b space, so ch_maxbufs
+ * never has to go over it.
+ */
+static unsigned int ch_blocksize(int f, int flags)
+{
+  unsigned int blksize = LBUFSIZE;
+  position_t   fsize;
+
+  if (flags & (CH_HELPFILE | CH_NODATA))
+    return (LBUFSIZE);
+
+  if (less::Globals::block_size > 0) {
+    position_t want = static_cast<position_t>(less::Globals::block_size) * 1024;
+    while (blksize < want && blksize < MAX_BLKSIZE)
+      blksize *= 2;
+    return (blksize);
+  }
+
+  if (!(flags & CH_CANSEEK)) {
+    /*
+     * A pipe is only held to the -b space with -B.
+     */
+    blksize = PIPE_BLKSIZE;
+    while (!less::Globals::autobuf && blksize > LBUFSIZE && maxbufspace >= 0
+           && static_cast<position_t>(blksize) * MIN_BIGBUFS > maxbufspace)
+      blksize /= 2;
+    return (blksize);
+  }
+
+  fsize = filename::filesize(f);
+  if (fsize == NULL_POSITION)
+    return (LBUFSIZE);
+  while (blksize < AUTO_BLKSIZE && fsize / blksize > AUTO_NBLOCKS
+         && (maxbufspace < 0 || static_cast<position_t>(blksize) * 2 * MIN_BIGBUFS <= maxbufspace))
+    blksize *= 2;
+  return (blksize);
+}
+
 /*
  * Force EOF to be at the current read position.
  * This is used after an ignore_eof read, during which the EOF may change.
@@ -925,6 +3084,8 @@ int seekable(int f)
 void set_eof()
 {
   thisfile->fsize = thisfile->fpos;
+  if (thisfile->mapaddr != nullptr && thisfile->mapsize > thisfile->fsize)
+    thisfile->fsize = thisfile->mapsize;
 }
 
 /*
@@ -936,36 +3097,56 @@ void init(int f, int flags)
   /*
    * See if we already have a filestate for this file.
    */
+  bool valid = false;
+
   thisfile = (struct filestate*)ifile::getCurrentIfile()->getFilestate();
   if (thisfile == nullptr) {
     /*
-     * Allocate and initialize a new filestate.
+     * Try to seek; set CH_CANSEEK if it works.
      */
-    thisfile               = (struct filestate*)calloc(1, sizeof(struct filestate));
-    thisfile->buflist.next = thisfile->buflist.prev = END_OF_CHAIN;
-    thisfile->nbufs                                 = 0;
-    thisfile->flags                                 = 0;
-    thisfile->fpos                                  = 0;
-    thisfile->block                                 = 0;
-    thisfile->offset                                = 0;
-    thisfile->file                                  = -1;
-    thisfile->fsize                                 = NULL_POSITION;
-    thisfile->flags                                 = flags;
-    init_hashtbl();
-
-    chDebug("init JJJ");
-    chDebug(to_string(thisfile));
+    if ((flags & CH_CANSEEK) && !seekable(f))
+      flags &= ~CH_CANSEEK;
 
     /*
-     * Try to seek; set CH_CANSEEK if it works.
+     * Allocate and initialize a new filestate.
      */
-    if ((flags & CH_CANSEEK) && !seekable(f))
-      thisfile->flags &= ~CH_CANSEEK;
+    thisfile          = (struct filestate*)calloc(1, sizeof(struct filestate));
+    thisfile->bs      = nullptr;
+    thisfile->flags   = 0;
+    thisfile->fpos    = 0;
+    thisfile->block   = 0;
+    thisfile->offset  = 0;
+    thisfile->file    = -1;
+    thisfile->fsize   = NULL_POSITION;
+    thisfile->mapaddr = nullptr;
+    thisfile->mapsize = 0;
+    thisfile->dfile   = -1;
+    thisfile->watch   = -1;
+    thisfile->dwatch  = -1;
+    thisfile->chain   = nullptr;
+    thisfile->nchain  = 0;
+    thisfile->base    = 0;
+    thisfile->flags   = flags;
+
     ifile::getCurrentIfile()->setFilestate((void*)thisfile);
   }
   if (thisfile->file == -1)
     thisfile->file = f;
-  flush();
+  if (thisfile->bs == nullptr) {
+    /*
+     * Get the file's blockset: from the block cache if we've
+     * seen this file before, otherwise a new one.
+     */
+    unsigned int blksize = ch_blocksize(thisfile->file, thisfile->flags);
+
+    thisfile->bs = cache_attach(thisfile->file, thisfile->flags, blksize, &valid);
+  }
+  thisfile->maxbufs = ch_maxbufs(thisfile->bs->blksize);
+
+  chDebug("init JJJ");
+  chDebug(to_string(thisfile));
+
+  ch_flush(valid);
 }
 
 /*
@@ -977,13 +3158,33 @@ void close()
   if (thisfile == nullptr)
     return;
 
+  /*
+   * Stop reading ahead before the file descriptor goes away.
+   */
+  ra_cancel();
+#if HAVE_MMAP
+  ch_unmap();
+#endif
+  fadv_close();
+  follow_stop();
+  chain_close();
+
   bool keepstate = false;
 
-  if (thisfile->flags & (CH_CANSEEK | CH_POPENED | CH_HELPFILE)) {
+  if (thisfile->bs->cached) {
+    /*
+     * Leave the buffers in the block cache, in case we come back.
+     */
+    thisfile->bs->users--;
+    cache_unlink(thisfile->bs);
+    cache_link_head(thisfile->bs);
+    thisfile->bs = nullptr;
+  } else if (thisfile->flags & (CH_CANSEEK | CH_POPENED | CH_HELPFILE)) {
     /*
      * We can seek or re-open, so we don't need to keep buffers.
      */
-    ch_delbufs();
+    bs_delete(thisfile->bs);
+    thisfile->bs = nullptr;
   } else
     keepstate = true;
   if (!(thisfile->flags & CH_KEEPOPEN)) {
@@ -1008,6 +3209,32 @@ void close()
   }
 }
 
+/*
+ * Return a new descriptor for the current file, so that it can be
+ * read (with pread) apart from the buffers, e.g. by another thread.
+ * Only a plain seekable file can be; otherwise return -1.
+ */
+int dupfile()
+{
+  if (thisfile == nullptr || !(thisfile->flags & CH_CANSEEK)
+      || (thisfile->flags & (CH_HELPFILE | CH_NODATA | CH_POPENED)) || thisfile->nchain > 0)
+    return (-1);
+  return (fcntl(thisfile->file, F_DUPFD_CLOEXEC, 0));
+}
+
+/*
+ * Has a key been pressed while waiting for data in follow mode?
+ * The key is left to be read as a command.
+ */
+
+bool follow_key_hit()
+{
+  bool hit = follow_key;
+
+  follow_key = false;
+  return (hit);
+}
+
 /*
  * Return thisfile->flags for the current file.
  */
@@ -1019,4 +3246,20 @@ int getflags()
   return (thisfile->flags);
 }
 
+/*
+ * Return the counters of blocks compressed with --compress.
+ */
+const zstats& compress_stats(void)
+{
+  return (zstat);
+}
+
+/*
+ * Return the counters of buffer slabs.
+ */
+const allocstats& alloc_stats(void)
+{
+  return (astat);
+}
+
 }; // namespace ch
\ No newline at end of file
@@ -10,24 +10,54 @@
 
 namespace ch {
 
-void       ungetchar(int c);
-void       end_logfile(void);
-void       sync_logfile(void);
-int        seek(position_t pos);
-int        end_seek(void);
-int        end_buffer_seek(void);
-int        beg_seek(void);
-position_t length(void);
-position_t tell(void);
-int        forw_get(void);
-int        back_get(void);
-void       setbufspace(int bufspace);
-void       flush(void);
-int        seekable(int f);
-void       set_eof(void);
-void       init(int f, int flags);
-void       close(void);
-int        getflags(void);
+/*
+ * Counters for blocks compressed with --compress.
+ */
+struct zstats {
+  long       compressed;   /* Blocks compressed */
+  long       decompressed; /* Blocks decompressed */
+  long       held;         /* Compressed blocks in memory now */
+  position_t rawbytes;     /* Their size before compression */
+  position_t zbytes;       /* and after */
+};
+
+/*
+ * Counters for the slabs buffers are allocated from.
+ */
+struct allocstats {
+  long       slabs;      /* Slabs allocated now */
+  long       hugeslabs;  /* How many of them use huge pages */
+  position_t slabbytes;  /* Bytes in them */
+  long       bufs;       /* Buffers in use */
+  long       freebufs;   /* Buffers free in the slabs */
+  long       slaballocs; /* Slabs allocated in all */
+  long       slabfrees;  /* Slabs freed in all */
+};
+
+void              ungetchar(int c);
+void              end_logfile(void);
+void              sync_logfile(void);
+int               seek(position_t pos);
+int               end_seek(void);
+int               end_buffer_seek(void);
+int               beg_seek(void);
+position_t        length(void);
+position_t        tell(void);
+int               forw_get(void);
+int               back_get(void);
+int               get_span(const unsigned char** spanp);
+int               get_span_back(const unsigned char** spanp);
+void              setbufspace(int bufspace);
+void              flush(void);
+int               seekable(int f);
+void              set_eof(void);
+void              init(int f, int flags);
+void              close(void);
+int               getflags(void);
+bool              follow_key_hit(void);
+int               dupfile(void);
+const zstats&     compress_stats(void);
+const allocstats& alloc_stats(void);
 
 } // namespace ch
 
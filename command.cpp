@@ -635,6 +635,7 @@ static void clear_buffers(void)
     return;
   ch::flush();
   linenum::clr_linenum();
+  input::clr_linestarts();
 #if HILITE_SEARCH
   search::clr_hilite();
 #endif
@@ -986,7 +987,7 @@ static int forw_loop(int until_hilite)
   curr_len                  = ch::length();
   highest_hilite            = until_hilite ? curr_len : NULL_POSITION;
   less::Globals::ignore_eoi = 1;
-  while (!less::Globals::sigs) {
+  while (!less::Globals::sigs && !ch::follow_key_hit()) {
     if (until_hilite && highest_hilite > curr_len) {
       screen::bell();
       break;
@@ -191,6 +191,9 @@ constexpr const int TABSTOP_MAX   = 128;  // Max number of custom tab stops
 /* GNU regex library */
 /* #undef HAVE_GNU_REGEX */
 
+/* Define HAVE_INOTIFY if you have inotify (Linux). */
+#define HAVE_INOTIFY 1
+
 /* Define to 1 if you have the <inttypes.h> header file. */
 #define HAVE_INTTYPES_H 1
 
@@ -203,6 +206,9 @@ constexpr const int TABSTOP_MAX   = 128;  // Max number of custom tab stops
 /* Define to 1 if you have the <memory.h> header file. */
 #define HAVE_MEMORY_H 1
 
+/* Define to 1 if you have the `mmap' function. */
+#define HAVE_MMAP 1
+
 /* Define HAVE_OSPEED if your termcap library has the ospeed variable. */
 #define HAVE_OSPEED 1
 
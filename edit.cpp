@@ -13,6 +13,7 @@
 #include "command.hpp"
 #include "filename.hpp"
 #include "ifile.hpp"
+#include "input.hpp"
 #include "less.hpp"
 #include "linenum.hpp"
 #include "mark.hpp"
@@ -425,6 +426,7 @@ int edit_ifile(ifile::Ifile* requestedIfile)
      */
     position::pos_clear();
     linenum::clr_linenum();
+    input::clr_linestarts();
 #if HILITE_SEARCH
     search::clr_hilite();
 #endif
@@ -24,10 +24,19 @@
 #include "option.hpp"
 #include "search.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <list>
+#include <map>
+#include <vector>
+
 // TODO: Move to namespace
 extern int        squeeze;
 extern int        chopline;
 extern int        hshift;
+extern int        ctldisp;
+extern int        sc_width;
 extern int        quit_if_one_screen;
 extern int        status_col;
 extern position_t start_attnpos;
@@ -39,6 +48,345 @@ extern int size_linebuf;
 
 namespace input {
 
+/*
+ * Cache of the raw lines we have seen, so that we needn't step back
+ * to the beginning of a line which is longer than the screen width
+ * each time we get one of its printable lines.  Each entry maps the
+ * position of the beginning of a raw line to the furthest position
+ * we know to be in it (its newline, if we have got that far).
+ * The whole cache is thrown away when it gets too big.
+ * (Where in such a line each printable line starts is kept by
+ * line.cpp, as checkpoints; see line::pcheckpoint.)
+ */
+#define LINESTARTS_MAX 4096
+
+static std::map<position_t, position_t> linestarts;
+
+/*
+ * Cache of the lines we have rendered, so that moving back and forth
+ * over the same part of the file needn't append every character to
+ * the line buffer again.  Each entry holds the line buffer left by
+ * forw_line or back_line for a position, and the position returned.
+ * The least recently used entry is dropped when there are too many.
+ * The whole cache is thrown away when anything which changes how
+ * lines look changes: options, the screen width, the shift, hiding
+ * or clearing the hilites, the attention hilite, or the length of
+ * the file.  When hilites or filters are added, only the lines which
+ * they overlap are thrown away.  A line which runs into the end of
+ * the file isn't kept, as more may be appended to it, nor is a line
+ * with a status column, which shows marks.
+ */
+#define RENDERED_MAX 1024
+
+struct rendered_line {
+  position_t     pos;     // Position passed to forw_line or back_line
+  bool           forw;    // Which of them it was
+  position_t     new_pos; // Position returned
+  position_t     lo;      // Range of the file the line depends on
+  position_t     hi;
+  bool           chopped; // The line was chopped
+  line::rendered r;       // The line buffer
+};
+
+typedef std::list<struct rendered_line>           rendered_list;
+typedef std::pair<position_t, bool>               rendered_id;
+static rendered_list                              rendered; // Most recently used first
+static std::map<rendered_id, rendered_list::iterator> rendered_index;
+static std::vector<position_t>                    rendered_key; // What the lines depend on
+static struct linecache_stats                     lcstat;
+
+/*
+ * Throw away all the rendered lines.
+ */
+static void clr_rendered(void)
+{
+  if (!rendered.empty())
+    lcstat.flushes++;
+  rendered.clear();
+  rendered_index.clear();
+  lcstat.held = 0;
+}
+
+/*
+ * Throw away one rendered line.
+ */
+static void del_rendered(rendered_list::iterator p)
+{
+  rendered_index.erase(rendered_id(p->pos, p->forw));
+  rendered.erase(p);
+  lcstat.held--;
+}
+
+/*
+ * Throw away the rendered lines which are out of date.
+ * Return false if lines can't be kept at all just now.
+ */
+static bool check_rendered(void)
+{
+  std::vector<int>        opts;
+  std::vector<position_t> key;
+
+  if (status_col)
+    return (false);
+  line::poptions(&opts);
+  key.assign(opts.begin(), opts.end());
+  key.insert(key.end(), { hshift, chopline, squeeze, ch::length(), start_attnpos, end_attnpos });
+#if HILITE_SEARCH
+  key.insert(key.end(), { hilite_search, search::hilite_serial() });
+#endif
+  if (key != rendered_key) {
+    clr_rendered();
+    rendered_key = key;
+  }
+
+#if HILITE_SEARCH
+  position_t spos;
+  position_t epos;
+  if (search::hilite_added(&spos, &epos)) {
+    rendered_list::iterator p = rendered.begin();
+    while (p != rendered.end()) {
+      if (p->lo <= epos && p->hi >= spos)
+        del_rendered(p++);
+      else
+        ++p;
+    }
+  }
+#endif
+  return (true);
+}
+
+/*
+ * If we have rendered the line which forw_line (or back_line)
+ * gets at pos, put it back in the line buffer and return true.
+ */
+static bool find_rendered(position_t pos, bool forw, position_t* new_posp)
+{
+  std::map<rendered_id, rendered_list::iterator>::iterator p;
+
+  if (!check_rendered())
+    return (false);
+  p = rendered_index.find(rendered_id(pos, forw));
+  if (p == rendered_index.end()) {
+    lcstat.misses++;
+    return (false);
+  }
+  lcstat.hits++;
+  rendered.splice(rendered.begin(), rendered, p->second);
+  line::pload(&p->second->r);
+  if (p->second->chopped)
+    quit_if_one_screen = false;
+  *new_posp = p->second->new_pos;
+  return (true);
+}
+
+/*
+ * Keep the line which forw_line (or back_line) has just rendered in
+ * the line buffer.  It was got at pos, depends on the part of the
+ * file from lo to hi, and new_pos was returned.
+ */
+static void add_rendered(position_t pos, bool forw, position_t new_pos, position_t lo, position_t hi, bool chopped)
+{
+  struct rendered_line rl;
+
+  if (!check_rendered() || rendered_index.count(rendered_id(pos, forw)))
+    return;
+  if (!line::psave(&rl.r))
+    return;
+  rl.pos     = pos;
+  rl.forw    = forw;
+  rl.new_pos = new_pos;
+  rl.lo      = lo;
+  rl.hi      = hi;
+  rl.chopped = chopped;
+  if (lcstat.held >= RENDERED_MAX)
+    del_rendered(std::prev(rendered.end()));
+  rendered.push_front(std::move(rl));
+  rendered_index.emplace(rendered_id(pos, forw), rendered.begin());
+  lcstat.held++;
+}
+
+/*
+ * Return the counters of the rendered line cache.
+ */
+const linecache_stats& line_cache_stats(void)
+{
+  return (lcstat);
+}
+
+/*
+ * Forget all the raw lines we have seen,
+ * and the lines we have rendered.
+ */
+void clr_linestarts(void)
+{
+  linestarts.clear();
+  line::pclr_checkpoints();
+  clr_rendered();
+}
+
+/*
+ * Remember that the positions from base_pos to end_pos
+ * are all in the raw line which begins at base_pos.
+ */
+static void add_linestart(position_t base_pos, position_t end_pos)
+{
+  std::map<position_t, position_t>::iterator p = linestarts.find(base_pos);
+
+  if (p != linestarts.end()) {
+    if (end_pos > p->second)
+      p->second = end_pos;
+    return;
+  }
+  if (linestarts.size() >= LINESTARTS_MAX)
+    linestarts.clear();
+  linestarts.emplace(base_pos, end_pos);
+}
+
+/*
+ * Find the beginning of the raw line which contains pos, if we have
+ * seen that part of it.  Return NULL_POSITION if we haven't.
+ */
+static position_t find_linestart(position_t pos)
+{
+  std::map<position_t, position_t>::iterator p = linestarts.upper_bound(pos);
+
+  if (p == linestarts.begin())
+    return (NULL_POSITION);
+  --p;
+  if (pos > p->second)
+    return (NULL_POSITION);
+  /*
+   * Make sure the file hasn't changed under us.
+   */
+  if (p->first > ch_zero && (ch::seek(p->first - 1) || ch::forw_get() != '\n')) {
+    linestarts.erase(p);
+    return (NULL_POSITION);
+  }
+  return (p->first);
+}
+
+/*
+ * Find the end of the raw line which begins at base_pos,
+ * if we have seen its newline.  Return the position after the
+ * newline (and leave the read pointer there), or NULL_POSITION.
+ */
+static position_t find_lineend(position_t base_pos)
+{
+  std::map<position_t, position_t>::iterator p = linestarts.find(base_pos);
+
+  if (p == linestarts.end() || ch::seek(p->second) || ch::forw_get() != '\n')
+    return (NULL_POSITION);
+  return (p->second + 1);
+}
+
+/*
+ * Find the start of the raw line which the char before the read
+ * pointer is in, by looking back a buffered span at a time for the
+ * newline which ends the line before it.  The start of the file (or
+ * of the part of it we still have) starts a line too.
+ * Return NULL_POSITION if we are interrupted.
+ */
+static position_t scan_linestart(void)
+{
+  const unsigned char* span;
+  const void*          nl;
+  int                  len;
+
+  for (;;) {
+    if (is_abort_signal(less::Globals::sigs))
+      return (NULL_POSITION);
+    if ((len = ch::get_span_back(&span)) == 0)
+      return (ch::tell());
+    if ((nl = memrchr(span, '\n', len)) != NULL)
+      return (ch::tell() - (span + len - ((const unsigned char*)nl + 1)));
+    (void)ch::seek(ch::tell() - len);
+  }
+}
+
+/*
+ * Append the run of plain chars at the read pointer, but not past
+ * limit, to the line buffer in one go (see line::pappend_plain),
+ * and move the read pointer past them.
+ * Return the number of chars appended.
+ */
+static int append_plain(position_t limit)
+{
+  const unsigned char* span;
+  position_t           pos = ch::tell();
+  int                  n;
+
+  if ((n = ch::get_span(&span)) == 0)
+    return (0);
+  if (limit - pos < n)
+    n = (int)(limit - pos);
+  n = line::pappend_plain(span, n, pos);
+  if (n > 0)
+    (void)ch::seek(pos + n);
+  return (n);
+}
+
+/*
+ * The line buffer has just been set up for the raw line which begins
+ * at base_pos, which is to be shifted hshift columns to the left.
+ * Skip whole screen widths of the line which would be shifted off the
+ * screen, splitting it as if it were wrapped so the checkpoints in it
+ * can be used and saved, but don't go past limit.  Return the position
+ * to carry on from (and leave the read pointer there).
+ */
+static position_t skip_shifted(position_t base_pos, position_t limit)
+{
+  position_t pos;
+  int        save_hshift;
+  int        backchars;
+  int        c;
+
+  pos = line::prestore(base_pos, limit, hshift);
+  (void)ch::seek(pos);
+  if (ctldisp == option::OPT_ON)
+    /* Lines are never split. */
+    return (pos);
+
+  save_hshift = hshift;
+  hshift      = 0;
+  while (line::get_cshift() + sc_width <= save_hshift && pos < limit && !is_abort_signal(less::Globals::sigs)) {
+    c = ch::forw_get();
+    if (c == '\n' || c == EOI) {
+      /*
+       * The whole line is shifted off the screen.
+       * Leave the newline for the caller.
+       */
+      if (c == '\n')
+        (void)ch::back_get();
+      break;
+    }
+    backchars = line::pappend(c, pos);
+    pos++;
+    if (backchars > 0) {
+      line::pshift_all();
+      pos -= backchars;
+      while (--backchars >= 0)
+        (void)ch::back_get();
+      line::pcheckpoint(base_pos, pos);
+      if (line::get_cshift() < 0) {
+        /*
+         * That printable line was short, so the rest of the
+         * line is out of step with the shifted line.
+         * Start again from the last checkpoint we can use.
+         */
+        hshift = save_hshift;
+        line::prewind();
+        line::plinenum(base_pos);
+        pos = line::prestore(base_pos, limit, hshift);
+        (void)ch::seek(pos);
+        return (pos);
+      }
+    } else
+      pos += append_plain(limit);
+  }
+  hshift = save_hshift;
+  return (pos);
+}
+
 /*
  * Get the next line.
  * A "current" position is passed and a "new" position is returned.
@@ -53,6 +401,10 @@ position_t forw_line(position_t curr_pos)
   int        c;
   int        blankline;
   int        backchars;
+  bool       skipped;
+  position_t key_pos = NULL_POSITION;
+  position_t lo_pos  = NULL_POSITION;
+  bool       at_eoi  = false;
 
 get_forw_line:
   if (curr_pos == NULL_POSITION) {
@@ -74,39 +426,57 @@ get_forw_line:
     curr_pos = search::next_unfiltered(curr_pos);
   }
 #endif
+  if (key_pos == NULL_POSITION) {
+    /*
+     * Use the line we rendered last time, if we have it.
+     */
+    key_pos = curr_pos;
+    if (find_rendered(curr_pos, true, &new_pos))
+      return (new_pos);
+  }
   if (ch::seek(curr_pos)) {
     line::null_line();
     return (NULL_POSITION);
   }
 
   /*
-   * Step back to the beginning of the line.
+   * Step back to the beginning of the line,
+   * unless we already know where it is.
    */
-  base_pos = curr_pos;
-  for (;;) {
-    debug::debug("forw_get - step back to beg of line - base_pos = ", base_pos);
-    if (is_abort_signal(less::Globals::sigs)) {
-      line::null_line();
-      return (NULL_POSITION);
-    }
-    c = ch::back_get();
-    if (c == EOI)
-      break;
-    if (c == '\n') {
-      (void)ch::forw_get();
-      break;
-    }
-    --base_pos;
+  if ((base_pos = find_linestart(curr_pos)) != NULL_POSITION)
+    goto found_base;
+  (void)ch::seek(curr_pos);
+  if ((base_pos = scan_linestart()) == NULL_POSITION) {
+    line::null_line();
+    return (NULL_POSITION);
   }
+  debug::debug("forw_get - step back to beg of line - base_pos = ", base_pos);
 
+found_base:
+  if (lo_pos == NULL_POSITION)
+    lo_pos = base_pos;
   debug::debug("forw_get - read_forward again");
   /*
    * Read forward again to the position we should start at.
    */
   line::prewind();
   line::plinenum(base_pos);
-  (void)ch::seek(base_pos);
-  new_pos = base_pos;
+  skipped = false;
+  if (!chopline && hshift == 0) {
+    /*
+     * Start from the last checkpoint before curr_pos.
+     */
+    new_pos = line::prestore(base_pos, curr_pos, INT_MAX);
+  } else if (hshift > 0 && curr_pos == base_pos) {
+    /*
+     * Skip the part of the line which is shifted off the screen.
+     */
+    new_pos = curr_pos = skip_shifted(base_pos, std::numeric_limits<position_t>::max());
+    skipped            = (new_pos > base_pos);
+  } else {
+    new_pos = base_pos;
+  }
+  (void)ch::seek(new_pos);
   while (new_pos < curr_pos) {
     if (is_abort_signal(less::Globals::sigs)) {
       line::null_line();
@@ -120,7 +490,10 @@ get_forw_line:
       new_pos -= backchars;
       while (--backchars >= 0)
         (void)ch::back_get();
-    }
+      if (hshift == 0)
+        line::pcheckpoint(base_pos, new_pos);
+    } else
+      new_pos += append_plain(curr_pos);
   }
   (void)line::pflushmbc();
   line::pshift_all();
@@ -130,11 +503,11 @@ get_forw_line:
    * Read the first character to display.
    */
   c = ch::forw_get();
-  if (c == EOI) {
+  if (c == EOI && !skipped) {
     line::null_line();
     return (NULL_POSITION);
   }
-  blankline = (c == '\n' || c == '\r');
+  blankline = !skipped && (c == '\n' || c == '\r');
 
   debug::debug("Read each character in the line and append to the line buffer");
   /*
@@ -154,6 +527,8 @@ get_forw_line:
       /*
        * End of the line.
        */
+      if (c == EOI)
+        at_eoi = true;
       backchars = line::pflushmbc();
       new_pos   = ch::tell();
       if (backchars > 0 && !chopline && hshift == 0) {
@@ -178,13 +553,19 @@ get_forw_line:
        * End the line here.
        */
       if (chopline || hshift > 0) {
-        do {
-          if (is_abort_signal(less::Globals::sigs)) {
-            line::null_line();
-            return (NULL_POSITION);
-          }
-          c = ch::forw_get();
-        } while (c != '\n' && c != EOI);
+        new_pos = ch::tell();
+        if (find_lineend(base_pos) == NULL_POSITION) {
+          (void)ch::seek(new_pos);
+          do {
+            if (is_abort_signal(less::Globals::sigs)) {
+              line::null_line();
+              return (NULL_POSITION);
+            }
+            c = ch::forw_get();
+          } while (c != '\n' && c != EOI);
+          if (c == EOI)
+            at_eoi = true;
+        }
         new_pos            = ch::tell();
         endline            = true;
         quit_if_one_screen = false;
@@ -195,10 +576,13 @@ get_forw_line:
       }
       break;
     }
+    if (append_plain(std::numeric_limits<position_t>::max()) > 0)
+      blankline = 0;
     c = ch::forw_get();
   }
 
   line::pdone(endline, chopped, 1);
+  add_linestart(base_pos, endline ? new_pos - 1 : new_pos);
 
 #if HILITE_SEARCH
   if (search::is_filtered(base_pos)) {
@@ -230,9 +614,13 @@ get_forw_line:
       }
     if (c != EOI)
       (void)ch::back_get();
+    else
+      at_eoi = true;
     new_pos = ch::tell();
   }
 
+  if (!at_eoi)
+    add_rendered(key_pos, true, new_pos, lo_pos, std::max(new_pos, ch::tell()), chopped);
   debug::debug("forw_line return new_pos = ", new_pos);
   return (new_pos);
 }
@@ -249,6 +637,7 @@ position_t back_line(position_t curr_pos)
   debug::debug("back_line called currpos", curr_pos);
   position_t new_pos, begin_new_pos, base_pos;
   int        c;
+  position_t key_pos = NULL_POSITION;
 
   int backchars;
 
@@ -263,6 +652,14 @@ get_back_line:
     search::prep_hilite((curr_pos < 3 * size_linebuf) ? 0 : curr_pos - 3 * size_linebuf, curr_pos, -1);
   }
 #endif
+  if (key_pos == NULL_POSITION) {
+    /*
+     * Use the line we rendered last time, if we have it.
+     */
+    key_pos = curr_pos;
+    if (find_rendered(curr_pos, false, &new_pos))
+      return (new_pos);
+  }
   if (ch::seek(curr_pos - 1)) {
     line::null_line();
     return (NULL_POSITION);
@@ -297,33 +694,19 @@ get_back_line:
   }
 
   /*
-   * Scan backwards until we hit the beginning of the line.
+   * Scan backwards until we hit the beginning of the line,
+   * unless we already know where it is.
    */
-  for (;;) {
-    if (is_abort_signal(less::Globals::sigs)) {
-      line::null_line();
-      return (NULL_POSITION);
-    }
-    c = ch::back_get();
-    if (c == '\n') {
-      /*
-       * This is the newline ending the previous line.
-       * We have hit the beginning of the line.
-       */
-      base_pos = ch::tell() + 1;
-      break;
-    }
-    if (c == EOI) {
-      /*
-       * We have hit the beginning of the file.
-       * This must be the first line in the file.
-       * This must, of course, be the beginning of the line.
-       */
-      base_pos = ch::tell();
-      break;
-    }
+  new_pos = ch::tell();
+  if ((base_pos = find_linestart(new_pos)) != NULL_POSITION)
+    goto found_base;
+  (void)ch::seek(new_pos);
+  if ((base_pos = scan_linestart()) == NULL_POSITION) {
+    line::null_line();
+    return (NULL_POSITION);
   }
 
+found_base:
   /*
    * Now scan forwards from the beginning of this line.
    * We keep discarding "printable lines" (based on screen width)
@@ -342,8 +725,22 @@ get_back_line:
   bool chopped = false;
   line::prewind();
   line::plinenum(new_pos);
+  begin_new_pos = base_pos;
+  if (!chopline && hshift == 0) {
+    /*
+     * Start from the last checkpoint before curr_pos.
+     */
+    new_pos = line::prestore(base_pos, curr_pos - 1, INT_MAX);
+  } else if (hshift > 0) {
+    /*
+     * Skip the part of the line which is shifted off the screen.
+     */
+    new_pos = skip_shifted(base_pos, curr_pos - 1);
+    goto shifted;
+  }
 loop:
   begin_new_pos = new_pos;
+shifted:
   (void)ch::seek(new_pos);
 
   do {
@@ -381,11 +778,14 @@ loop:
         (void)ch::back_get();
         new_pos--;
       }
+      line::pcheckpoint(base_pos, new_pos);
       goto loop;
     }
+    new_pos += append_plain(curr_pos);
   } while (new_pos < curr_pos);
 
   line::pdone(endline, chopped, 0);
+  add_linestart(base_pos, new_pos - 1);
 
 #if HILITE_SEARCH
   if (search::is_filtered(base_pos)) {
@@ -403,6 +803,7 @@ loop:
   }
 #endif
 
+  add_rendered(key_pos, false, begin_new_pos, base_pos, key_pos, chopped);
   return (begin_new_pos);
 }
 
@@ -15,9 +15,21 @@
 
 namespace input {
 
+/*
+ * Counters for the cache of rendered lines.
+ */
+struct linecache_stats {
+  long hits;    /* Lines found in the cache */
+  long misses;  /* Lines rendered */
+  long held;    /* Lines in the cache now */
+  long flushes; /* Times the whole cache was thrown away */
+};
+
 position_t forw_line(position_t curr_pos);
 position_t back_line(position_t curr_pos);
 void       set_attnpos(position_t pos);
+void       clr_linestarts(void);
+const linecache_stats& line_cache_stats(void);
 
 } // namespace input
 #endif
\ No newline at end of file
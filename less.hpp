@@ -359,7 +359,17 @@ struct Globals {
   static int sigs;
 
   // From ch:
-  static int ignore_eoi;
+  static int   ignore_eoi;
+  static int   use_mmap;   // Memory-map seekable files instead of buffering
+  static int   read_ahead; // Number of blocks to read ahead in the background
+  static int   block_size; // Buffer block size in K; 0 means choose per file
+  static int   cache_size; // Block cache budget in K; -1 means no limit
+  static int   spill;      // Spill evicted pipe blocks to a file
+  static char* spill_dir;  // Directory for spill files
+  static int   compress;   // Compress evicted pipe blocks in memory
+  static int   huge_pages; // Ask for huge pages for buffer slabs
+  static int   fadvise;    // Keep page cache use down with posix_fadvise
+  static int   direct_io;  // Read seekable files with O_DIRECT
 
   // From charset
   static int utf_mode;
@@ -377,6 +387,16 @@ inline int   Globals::follow_mode   = 0;
 inline int   Globals::autobuf       = 0;
 inline int   Globals::sigs          = 0;
 inline int   Globals::ignore_eoi    = 0;
+inline int   Globals::use_mmap      = 0;
+inline int   Globals::read_ahead    = 0;
+inline int   Globals::block_size    = 0;
+inline int   Globals::cache_size    = 65536;
+inline int   Globals::spill         = 0;
+inline char* Globals::spill_dir     = nullptr;
+inline int   Globals::compress      = 0;
+inline int   Globals::huge_pages    = 0;
+inline int   Globals::fadvise       = 0;
+inline int   Globals::direct_io     = 0;
 inline int   Globals::utf_mode      = 0;
 inline int   Globals::binattr       = AT_STANDOUT;
 inline char  Globals::openquote     = '"';
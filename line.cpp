@@ -27,6 +27,13 @@
 #include "search.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
 // TODO: move to namespaces
 static char*      linebuf      = NULL;           /* Buffer which holds the current output line */
 static char*      attr         = NULL;           /* Extension of linebuf to hold attributes */
@@ -49,6 +56,9 @@ static lwchar_t   pendc;
 static position_t pendpos;
 static char*      end_ansi_chars;
 static char*      mid_ansi_chars;
+static int        prefix_curr; /* Length of the line number and status column */
+static bool       cshift_exact; /* Every printable line shifted off filled the screen */
+static bool       linenum_missing; /* The line number couldn't be found */
 
 extern int bs_mode;
 extern int linenums;
@@ -78,6 +88,15 @@ static int        mbc_buf_len   = 0;
 static int        mbc_buf_index = 0;
 static position_t mbc_pos;
 
+static char       plain_chars[256]; /* Chars which need no special handling */
+static bool       plain_ascii;      /* All of ' ' to '~' are plain */
+
+#if HILITE_SEARCH
+static position_t hl_lo; /* Range of positions which are all hilited, */
+static position_t hl_hi; /* or all not, as hl_on says */
+static bool       hl_on;
+#endif
+
 /*
  * Initialize from environment variables.
  */
@@ -95,6 +114,17 @@ void init_line(void)
   linebuf      = (char*)utils::ecalloc(LINEBUF_SIZE, sizeof(char));
   attr         = (char*)utils::ecalloc(LINEBUF_SIZE, sizeof(char));
   size_linebuf = LINEBUF_SIZE;
+
+  /*
+   * Plain chars are printable ASCII chars which take one column and
+   * can be copied straight into the line buffer (see pappend_plain).
+   */
+  plain_ascii = true;
+  for (int c = 0; c < 256; c++) {
+    plain_chars[c] = (c < 0x80 && c != '\b' && c != '\t' && c != '\r' && !is_csi_start(c) && !charset::control_char(c));
+    if (c >= ' ' && c <= '~' && !plain_chars[c])
+      plain_ascii = false;
+  }
 }
 
 /*
@@ -155,14 +185,19 @@ void prewind(void)
   right_curr      = 0;
   right_column    = 0;
   cshift          = 0;
+  cshift_exact    = true;
   overstrike      = 0;
   last_overstrike = AT_NORMAL;
   mbc_buf_len     = 0;
   is_null_line    = 0;
+  linenum_missing = false;
   pendc           = '\0';
   lmargin         = 0;
   if (status_col)
     lmargin += 2;
+#if HILITE_SEARCH
+  hl_lo = hl_hi = 0;
+#endif
 }
 
 /*
@@ -201,7 +236,8 @@ void plinenum(position_t pos)
      * {{ Since forw_raw_line modifies linebuf, we must
      *    do this first, before storing anything in linebuf. }}
      */
-    linenum = linenum::find_linenum(pos);
+    linenum         = linenum::find_linenum(pos);
+    linenum_missing = (linenum == 0);
   }
 
   /*
@@ -255,6 +291,7 @@ void plinenum(position_t pos)
   while (column < lmargin) {
     add_linebuf(' ', AT_NORMAL, 1);
   }
+  prefix_curr = curr;
 }
 
 /*
@@ -371,7 +408,23 @@ static void pshift(int shift)
 
 void pshift_all(void)
 {
+  if (column < sc_width)
+    cshift_exact = false;
   pshift(column);
+  /* Nothing is left to the right of here. */
+  right_curr   = curr;
+  right_column = column;
+}
+
+/*
+ * Return the number of columns shifted off the line so far, or -1
+ * if a printable line shifted off ended short of the screen width
+ * (so the rest of the line is not where it would be if the line
+ * were shifted horizontally).
+ */
+int get_cshift(void)
+{
+  return (cshift_exact ? cshift : -1);
 }
 
 /*
@@ -559,6 +612,21 @@ void skip_ansi(char** pp, const char* limit)
   /* Note that we discard final char, for which is_ansi_middle is false. */
 }
 
+#if HILITE_SEARCH
+/*
+ * Should the char at pos be highlighted?
+ * The hilites are looked up a run at a time (see search::hilite_run),
+ * so that a line needs a lookup where the highlighting changes,
+ * rather than one for every char.
+ */
+static bool is_hilited_pos(position_t pos)
+{
+  if (pos < hl_lo || (hl_hi != NULL_POSITION && pos >= hl_hi))
+    hl_on = search::hilite_run(pos, &hl_lo, &hl_hi);
+  return (hl_on);
+}
+#endif
+
 /*
  * Append a character and attribute to the line buffer.
  */
@@ -579,18 +647,15 @@ static int store_char(lwchar_t ch, int a, char* rep, position_t pos)
     last_overstrike = w;
 
 #if HILITE_SEARCH
-  {
-    int matches;
-    if (search::is_hilited(pos, pos + 1, 0, &matches)) {
-      /*
-       * This character should be highlighted.
-       * Override the attribute passed in.
-       */
-      if (a != AT_ANSI) {
-        if (highest_hilite != NULL_POSITION && pos > highest_hilite)
-          highest_hilite = pos;
-        a |= AT_HILITE;
-      }
+  if (is_hilited_pos(pos)) {
+    /*
+     * This character should be highlighted.
+     * Override the attribute passed in.
+     */
+    if (a != AT_ANSI) {
+      if (highest_hilite != NULL_POSITION && pos > highest_hilite)
+        highest_hilite = pos;
+      a |= AT_HILITE;
     }
   }
 #endif
@@ -723,6 +788,79 @@ static int flush_mbc_buf(position_t pos)
   return 0;
 }
 
+/*
+ * Return the length of the run of plain chars at the start of s,
+ * which holds n chars.  If all printable ASCII is plain, look at
+ * the chars a word at a time until we get to one which isn't.
+ */
+static int plain_run(const unsigned char* s, int n)
+{
+  const uint64_t ones  = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  uint64_t       w;
+  int            i = 0;
+
+  if (plain_ascii) {
+    for (; i + (int)sizeof(w) <= n; i += sizeof(w)) {
+      memcpy(&w, s + i, sizeof(w));
+      /* Is any byte below ' ' or above '~'? */
+      if ((((w - ones * ' ') & ~w) | (w + ones) | w) & highs)
+        break;
+    }
+  }
+  while (i < n && plain_chars[s[i]])
+    i++;
+  return (i);
+}
+
+/*
+ * Append a run of plain chars to the line buffer in one go.
+ * s holds n chars from the file, starting at position pos.
+ * Stop where a char needs pappend: one which isn't plain, or one
+ * which won't fit on the screen, or which shifts the line.
+ * Hilited chars are left to pappend too.
+ * Returns the number of chars appended.
+ */
+int pappend_plain(const unsigned char* s, int n, position_t pos)
+{
+  if (pendc || mbc_buf_len > 0 || overstrike != 0)
+    return (0);
+  /*
+   * The first char would need the previous attribute to be ended,
+   * or would end an ANSI escape sequence.
+   */
+  if (curr > 0 && !screen::is_at_equiv(attr[curr - 1], AT_NORMAL))
+    return (0);
+  if (ctldisp == option::OPT_ONPLUS && in_ansi_esc_seq())
+    return (0);
+
+  if (ctldisp != option::OPT_ON && n > sc_width - column)
+    n = sc_width - column;
+  if (cshift < hshift && n > sc_width / 2 - column)
+    n = sc_width / 2 - column;
+  if (n <= 0 || (n = plain_run(s, n)) == 0)
+    return (0);
+#if HILITE_SEARCH
+  if (is_hilited_pos(pos))
+    return (0);
+  if (hl_hi != NULL_POSITION && n > hl_hi - pos)
+    n = (int)(hl_hi - pos);
+#endif
+
+  while (curr + n >= size_linebuf - 6)
+    if (expand_linebuf())
+      return (0);
+  if (column + n - 1 > right_column) {
+    right_column = column + n - 1;
+    right_curr   = curr + n - 1;
+  }
+  memcpy(linebuf + curr, s, n);
+  memset(attr + curr, AT_NORMAL, n);
+  curr += n;
+  column += n;
+  return (n);
+}
+
 /*
  * Append a character to the line buffer.
  * Expand tabs into spaces, handle underlining, boldfacing, etc.
@@ -1096,43 +1234,277 @@ void null_line(void)
   cshift       = 0;
 }
 
+/*
+ * Checkpoints in long lines.
+ *
+ * To get a printable line from the middle of a raw line which is much
+ * longer than the screen width, input::forw_line and back_line have
+ * to append everything before it to the line buffer, one printable
+ * line at a time, to find where it starts.  So every CKPT_SPACING
+ * bytes of such a line, at the start of a printable line, we save the
+ * state of the line buffer; next time, we start from the nearest
+ * checkpoint instead of the beginning of the raw line.
+ *
+ * A checkpoint holds whatever pshift_all leaves in the line buffer
+ * after the line number (the ANSI sequences seen so far, if -R),
+ * and cshift, which is the number of columns before it; so it also
+ * lets a horizontally shifted line start near the shift, as long as
+ * every printable line before it filled the screen exactly (a tab or
+ * wide character which doesn't fit leaves a gap which a shifted line
+ * doesn't have).
+ * Checkpoints depend on the options which change how wide
+ * characters are, so they are all thrown away when those change.
+ * We don't keep any if the terminal's attribute sequences take up
+ * space, since then the width of a character depends on hiliting.
+ */
+#define CKPT_SPACING (8 * 1024) // Least bytes between checkpoints
+#define CKPT_MAX (64 * 1024)    // Most checkpoints kept
+#define CKPT_MAX_TAIL 256       // Most of the line buffer kept in one
+
+struct checkpoint {
+  position_t  pos;             // Start of the printable line
+  int         prefix;          // Length of the line number and status column
+  int         lmargin;         // lmargin
+  int         cshift;          // Columns before pos
+  int         hshift_min;      // Least hshift it may be used for
+  int         column;          // column
+  int         right_curr;      // right_curr - prefix
+  int         right_column;    // right_column
+  int         overstrike;      // overstrike
+  int         last_overstrike; // last_overstrike
+  lwchar_t    pendc;           // pendc
+  position_t  pendpos;         // pendpos
+  std::string buf;             // linebuf and attr after the prefix
+  std::string attrs;
+};
+
+static std::map<position_t, std::vector<struct checkpoint>> checkpoints; // By start of raw line
+static size_t                                                ncheckpoints;
+static std::vector<int>                                      ckpt_key; // Options they were made with
+
+/*
+ * Append the settings which change how a line is rendered
+ * (other than hiliting and horizontal shifting) to *key.
+ */
+void poptions(std::vector<int>* key)
+{
+  key->insert(key->end(), { sc_width, ctldisp, bs_mode, less::Globals::utf_mode, less::Globals::binattr,
+                            status_col, linenums, tabdefault, ntabstops, rscroll_char, rscroll_attr,
+                            auto_wrap, ignaw, bo_s_width, bo_e_width, ul_s_width, ul_e_width, bl_s_width,
+                            bl_e_width, so_s_width, so_e_width });
+  key->insert(key->end(), tabstops, tabstops + ntabstops);
+}
+
+/*
+ * Throw away all the checkpoints.
+ */
+void pclr_checkpoints(void)
+{
+  checkpoints.clear();
+  ncheckpoints = 0;
+}
+
+/*
+ * Can we use checkpoints now?
+ */
+static bool ckpt_usable(void)
+{
+  if (sc_width == INT_MAX || ctldisp == option::OPT_ON || bo_s_width || bo_e_width || ul_s_width || ul_e_width
+      || bl_s_width || bl_e_width || so_s_width || so_e_width)
+    /*
+     * Lines are being measured (rrshift), lines are never
+     * split, or the width of a character depends on its hiliting.
+     */
+    return (false);
+
+  std::vector<int> key;
+  poptions(&key);
+  if (key != ckpt_key) {
+    pclr_checkpoints();
+    ckpt_key = key;
+  }
+  return (true);
+}
+
+/*
+ * We have just called pshift_all at pos, the start of a printable line
+ * in the raw line which starts at base.  Save the state of the line
+ * buffer, if it is far enough from the last checkpoint.
+ */
+void pcheckpoint(position_t base, position_t pos)
+{
+  struct checkpoint ck;
+
+  if (mbc_buf_len > 0 || curr - prefix_curr > CKPT_MAX_TAIL || !ckpt_usable())
+    return;
+  std::vector<struct checkpoint>& v = checkpoints[base];
+  if (pos < (v.empty() ? base : v.back().pos) + CKPT_SPACING)
+    return;
+  if (ncheckpoints >= CKPT_MAX) {
+    pclr_checkpoints();
+    return;
+  }
+
+  ck.pos             = pos;
+  ck.prefix          = prefix_curr;
+  ck.lmargin         = lmargin;
+  ck.cshift          = cshift;
+  ck.hshift_min      = cshift_exact ? cshift : INT_MAX;
+  ck.column          = column;
+  ck.right_curr      = right_curr - prefix_curr;
+  ck.right_column    = right_column;
+  ck.overstrike      = overstrike;
+  ck.last_overstrike = last_overstrike;
+  ck.pendc           = pendc;
+  ck.pendpos         = pendpos;
+  ck.buf.assign(linebuf + prefix_curr, curr - prefix_curr);
+  ck.attrs.assign(attr + prefix_curr, curr - prefix_curr);
+  v.push_back(std::move(ck));
+  ncheckpoints++;
+}
+
+/*
+ * The line buffer has just been set up (prewind and plinenum) for the
+ * raw line which starts at base.  Restore it to the last checkpoint
+ * in the line at or before pos, and with no more than cols columns
+ * before it (cols is INT_MAX unless the line is shifted).
+ * Return the checkpoint's position, or base if there is none.
+ */
+position_t prestore(position_t base, position_t pos, int cols)
+{
+  std::map<position_t, std::vector<struct checkpoint>>::iterator p;
+  std::vector<struct checkpoint>::iterator                       ck;
+
+  if (!ckpt_usable() || (p = checkpoints.find(base)) == checkpoints.end())
+    return (base);
+  std::vector<struct checkpoint>& v = p->second;
+
+  /*
+   * Both the position and the shift grow along the line.
+   */
+  ck = std::upper_bound(v.begin(), v.end(), pos,
+                        [](position_t x, const struct checkpoint& c) { return (x < c.pos); });
+  ck = std::min(ck, std::upper_bound(v.begin(), v.end(), cols,
+                                     [](int x, const struct checkpoint& c) { return (x < c.hshift_min); }));
+  if (ck == v.begin())
+    return (base);
+  --ck;
+  if (ck->prefix != curr || ck->lmargin != lmargin)
+    /* The line number has changed width. */
+    return (base);
+
+  memcpy(linebuf + curr, ck->buf.data(), ck->buf.size());
+  memcpy(attr + curr, ck->attrs.data(), ck->attrs.size());
+  curr += static_cast<int>(ck->buf.size());
+  cshift          = ck->cshift;
+  cshift_exact    = (ck->hshift_min != INT_MAX);
+  column          = ck->column;
+  right_curr      = ck->right_curr + ck->prefix;
+  right_column    = ck->right_column;
+  overstrike      = ck->overstrike;
+  last_overstrike = ck->last_overstrike;
+  pendc           = ck->pendc;
+  pendpos         = ck->pendpos;
+  return (ck->pos);
+}
+
+/*
+ * Save the line left in the line buffer by pdone in *r.
+ * Return false if it isn't worth saving: there is no line,
+ * or its line number couldn't be found.
+ */
+bool psave(struct rendered* r)
+{
+  if (is_null_line || linenum_missing)
+    return (false);
+  r->chars.assign(linebuf, curr + 1); /* With the '\0' pdone put after it */
+  r->attrs.assign(attr, curr + 1);
+  r->column = column;
+  return (true);
+}
+
+/*
+ * Put a line saved by psave back in the line buffer.
+ */
+void pload(const struct rendered* r)
+{
+  int len = static_cast<int>(r->chars.size());
+
+  while (size_linebuf < len)
+    if (expand_linebuf()) {
+      null_line();
+      return;
+    }
+  memcpy(linebuf, r->chars.data(), len);
+  memcpy(attr, r->attrs.data(), len);
+  curr         = len - 1;
+  column       = r->column;
+  is_null_line = 0;
+}
+
 /*
  * Analogous to forw_line(), but deals with "raw lines":
  * lines which are not split for screen width.
  * {{ This is supposed to be more efficient than forw_line(). }}
+ *
+ * The line is read a span at a time (see ch::get_span), so the
+ * newline is found with memchr and the text is copied in bulk.
+ * If the caller doesn't want the text, it isn't copied at all.
  */
 
 position_t forw_raw_line(position_t curr_pos, char** linep, int* line_lenp)
 {
-  int        n;
-  int        c;
-  position_t new_pos;
-
-  if (curr_pos == NULL_POSITION || ch::seek(curr_pos) || (c = ch::forw_get()) == EOI)
+  int                  n;
+  int                  len;
+  int                  take;
+  const unsigned char* span;
+  const unsigned char* nl;
+  position_t           new_pos;
+
+  if (curr_pos == NULL_POSITION || ch::seek(curr_pos) || (len = ch::get_span(&span)) == 0)
     return (NULL_POSITION);
 
   n = 0;
   for (;;) {
-    if (c == '\n' || c == EOI || is_abort_signal(less::Globals::sigs)) {
+    if (is_abort_signal(less::Globals::sigs)) {
       new_pos = ch::tell();
       break;
     }
-    if (n >= size_linebuf - 1) {
-      if (expand_linebuf()) {
-        /*
-         * Overflowed the input buffer.
-         * Pretend the line ended here.
-         */
-        new_pos = ch::tell() - 1;
-        break;
+    nl   = (const unsigned char*)memchr(span, '\n', len);
+    take = (nl != NULL) ? (int)(nl - span) : len;
+    if (linep != NULL) {
+      while (n + take >= size_linebuf) {
+        if (expand_linebuf()) {
+          /*
+           * Overflowed the input buffer.
+           * Pretend the line ended here.
+           */
+          take = size_linebuf - 1 - n;
+          nl   = NULL;
+          len  = -1;
+          break;
+        }
       }
+      memcpy(linebuf + n, span, take);
     }
-    linebuf[n++] = c;
-    c            = ch::forw_get();
+    n += take;
+    new_pos = ch::tell() + take;
+    if (nl != NULL) {
+      /*
+       * Skip the newline.
+       */
+      new_pos++;
+      (void)ch::seek(new_pos);
+      break;
+    }
+    (void)ch::seek(new_pos);
+    if (len < 0 || (len = ch::get_span(&span)) == 0)
+      break;
+  }
+  if (linep != NULL) {
+    linebuf[n] = '\0';
+    *linep     = linebuf;
   }
-  linebuf[n] = '\0';
-  if (linep != NULL)
-    *linep = linebuf;
   if (line_lenp != NULL)
     *line_lenp = n;
   return (new_pos);
@@ -1141,30 +1513,34 @@ position_t forw_raw_line(position_t curr_pos, char** linep, int* line_lenp)
 /*
  * Analogous to back_line(), but deals with "raw lines".
  * {{ This is supposed to be more efficient than back_line(). }}
+ *
+ * Like forw_raw_line, this works a span at a time,
+ * using memrchr to find the start of the line.
  */
 
 position_t back_raw_line(position_t curr_pos, char** linep, int* line_lenp)
 {
-  int        n;
-  int        c;
-  position_t new_pos;
+  int                  n;
+  int                  len;
+  int                  take;
+  int                  count;
+  const unsigned char* span;
+  const unsigned char* nl;
+  position_t           new_pos;
 
   if (curr_pos == NULL_POSITION || curr_pos <= ch_zero || ch::seek(curr_pos - 1))
     return (NULL_POSITION);
 
   n            = size_linebuf;
   linebuf[--n] = '\0';
+  count        = 0;
   for (;;) {
-    c = ch::back_get();
-    if (c == '\n' || is_abort_signal(less::Globals::sigs)) {
-      /*
-       * This is the newline ending the previous line.
-       * We have hit the beginning of the line.
-       */
-      new_pos = ch::tell() + 1;
+    if (is_abort_signal(less::Globals::sigs)) {
+      new_pos = ch::tell();
       break;
     }
-    if (c == EOI) {
+    len = ch::get_span_back(&span);
+    if (len == 0) {
       /*
        * We have hit the beginning of the file.
        * This must be the first line in the file.
@@ -1173,31 +1549,56 @@ position_t back_raw_line(position_t curr_pos, char** linep, int* line_lenp)
       new_pos = ch_zero;
       break;
     }
-    if (n <= 0) {
-      int   old_size_linebuf = size_linebuf;
-      char* fm;
-      char* to;
-      if (expand_linebuf()) {
+    nl   = (const unsigned char*)memrchr(span, '\n', len);
+    take = (nl != NULL) ? (int)(span + len - (nl + 1)) : len;
+    if (linep != NULL && n < take) {
+      int  old_size_linebuf = size_linebuf;
+      bool overflow         = false;
+
+      /*
+       * Grow linebuf until the text fits, then move what we
+       * have so far to the end of it in one go.
+       */
+      while (n + (size_linebuf - old_size_linebuf) < take) {
+        if (expand_linebuf()) {
+          overflow = true;
+          break;
+        }
+      }
+      if (size_linebuf > old_size_linebuf) {
+        memmove(linebuf + n + (size_linebuf - old_size_linebuf), linebuf + n, old_size_linebuf - n);
+        n += size_linebuf - old_size_linebuf;
+      }
+      if (overflow) {
         /*
          * Overflowed the input buffer.
          * Pretend the line ended here.
          */
-        new_pos = ch::tell() + 1;
-        break;
+        take = n;
+        nl   = span;
       }
+    }
+    if (linep != NULL) {
+      n -= take;
+      memcpy(linebuf + n, span + len - take, take);
+    }
+    count += take;
+    new_pos = ch::tell() - take;
+    if (nl != NULL) {
       /*
-       * Shift the data to the end of the new linebuf.
+       * This is the newline ending the previous line.
+       * We have hit the beginning of the line.
+       * Leave the read pointer on the newline.
        */
-      for (fm = linebuf + old_size_linebuf - 1, to = linebuf + size_linebuf - 1; fm >= linebuf; fm--, to--)
-        *to = *fm;
-      n = size_linebuf - old_size_linebuf;
+      (void)ch::seek(new_pos - 1);
+      break;
     }
-    linebuf[--n] = c;
+    (void)ch::seek(new_pos);
   }
   if (linep != NULL)
     *linep = &linebuf[n];
   if (line_lenp != NULL)
-    *line_lenp = size_linebuf - 1 - n;
+    *line_lenp = count;
   return (new_pos);
 }
 
@@ -9,8 +9,20 @@
 
 #include "less.hpp"
 
+#include <string>
+#include <vector>
+
 namespace line {
 
+/*
+ * A rendered line, as saved by psave.
+ */
+struct rendered {
+  std::string chars; /* linebuf */
+  std::string attrs; /* attr */
+  int         column;
+};
+
 void       init_line(void);
 int        is_ascii_char(lwchar_t ch); // not used
 void       prewind(void);
@@ -20,8 +32,16 @@ int        is_ansi_end(lwchar_t ch); // not used
 int        is_ansi_middle(lwchar_t ch);
 void       skip_ansi(char** pp, const char* limit);
 int        pappend(int c, position_t pos);
+int        pappend_plain(const unsigned char* s, int n, position_t pos);
 int        pflushmbc(void);
 void       pdone(bool endline, bool chopped, int forw);
+void       poptions(std::vector<int>* key);
+void       pclr_checkpoints(void);
+void       pcheckpoint(position_t base, position_t pos);
+position_t prestore(position_t base, position_t pos, int cols);
+int        get_cshift(void);
+bool       psave(struct rendered* r);
+void       pload(const struct rendered* r);
 void       set_status_col(int c);
 int        gline(int i, int* ap);
 void       null_line(void);
@@ -23,7 +23,9 @@
  * other line numbers.   For example, we'd rather keep lines
  * 100,200,300 than 100,101,300.  200 is more interesting than
  * 101 because 101 can be derived very cheaply from 100, while
- * 200 is more expensive to derive from 100.
+ * 200 is more expensive to derive from 100.  It is also more
+ * interesting when it is near the part of the file on the screen,
+ * because that is where the user is likely to ask next.
  *
  * The function currline() returns the line number of a given
  * position in the file.  As a side effect, it calls add_lnum
@@ -33,7 +35,10 @@
 
 #include "linenum.hpp"
 #include "ch.hpp"
+#include "decode.hpp"
+#include "filename.hpp"
 #include "forwback.hpp"
+#include "ifile.hpp"
 #include "less.hpp"
 #include "line.hpp"
 #include "option.hpp"
@@ -42,6 +47,23 @@
 #include "position.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 // TODO: Move to namespaces
 extern int linenums;
 extern int sc_height;
@@ -50,159 +72,741 @@ namespace linenum {
 
 /*
  * Structure to keep track of a line number and the associated file position.
- * A doubly-linked circular list of line numbers is kept ordered by line number.
+ * The table of line numbers is kept in an array sorted by position
+ * (and so by line number), so an entry is found with a binary search.
+ * The first entry is always line 1 at position 0.
  */
 struct linenum_info {
-  struct linenum_info* next; // Link to next in the list
-  struct linenum_info* prev; // Line to previous in the list
-  position_t           pos;  // File position
-  position_t           gap;  // Gap between prev and next
-  linenum_t            line; // Line number
+  position_t pos;  // File position
+  linenum_t  line; // Line number
 };
+
 /*
- * "gap" needs some explanation: the gap of any particular line number
- * is the distance between the previous one and the next one in the list.
- * ("Distance" means difference in file position.)  In other words, the
- * gap of a line number is the gap which would be introduced if this
- * line number were deleted.  It is used to decide which one to replace
- * when we have a new one to insert and the table is full.
+ * The table holds one entry per LNUM_SPACING bytes of the file,
+ * but at least LNUM_MIN and at most LNUM_MAX entries.  When it is
+ * full, 1/LNUM_EVICT of the entries are thrown away at once, so the
+ * cost of choosing them is shared among many additions.
+ *
+ * An entry is chosen by its "gap": the distance between the previous
+ * and the next entry, which is the gap that would be introduced if this
+ * one were deleted.  ("Distance" means difference in file position.)
+ * The gap is scaled down by the entry's distance from the top of the
+ * screen in units of LNUM_NEAR, so entries are kept evenly spread
+ * near the screen and more and more thinly further away.
  */
-
-#define NPOOL 200 // Size of line number pool
+#define LNUM_MIN 200               // Least size of the table
+#define LNUM_MAX (64 * 1024)       // Greatest size of the table
+#define LNUM_SPACING (16 * 1024)   // Bytes of file per entry
+#define LNUM_EVICT 8               // Fraction of entries to evict
+#define LNUM_NEAR (1024 * 1024)    // Bytes from the screen counted as near
 
 #define LONGTIME (2) // In seconds
 
-static struct linenum_info  anchor;      // Anchor of the list
-static struct linenum_info* freelist;    // Anchor of the unused entries
-static struct linenum_info  pool[NPOOL]; // The pool itself
-static struct linenum_info* spare;       // We always keep one spare entry
+static std::vector<struct linenum_info> lnums{ { 0, 1 } }; // The table
 
 /*
- * Initialize the line number structures.
+ * The newline index.
+ *
+ * Walking a big file line by line from the nearest cached line number
+ * can take seconds.  So the first time we would walk more than
+ * IDX_MIN_WALK bytes of a seekable file, we start counting the newlines
+ * in the whole file in the background, in IDX_CHUNK pieces, with one
+ * thread per processor (up to IDX_MAX_THREADS), each counting a part
+ * of the file with memchr.  The threads read the file through their
+ * own descriptor, so they never touch the buffers.
+ *
+ * When they have finished, before[k] holds the number of newlines
+ * before position k * IDX_CHUNK, and a line number or position is
+ * found with a binary search plus a scan of at most one chunk.
+ * Until then (and past the end of what was indexed) we walk as before,
+ * switching to the index if it becomes ready during a long walk.
+ * The index is thrown away with the rest of the line number cache.
+ *
+ * The newline counts are also saved in a cache directory, in a file
+ * named after the device and inode of the file.  When the file is
+ * opened again, the saved counts are used if the size and modification
+ * time are unchanged and the first and last chunks indexed still hash
+ * to the same values.  If the file has only grown, the counts of the
+ * complete chunks are kept and only the rest of the file is counted.
+ * Each time an index is saved, the directory is pruned: indexes of
+ * files which are gone or have been replaced (as when a log is rotated)
+ * are removed, and then the oldest are removed until there are at most
+ * IDX_KEEP_FILES of them, taking at most IDX_KEEP_BYTES in all.
+ *
+ * If the file grows while we are viewing it (as in follow mode), the
+ * index is extended over the new part the next time a line number
+ * past its end is wanted, counting just the new bytes with memchr.
+ * When following, the file is indexed whatever its size, so the line
+ * count costs the same for each block appended.
  */
-void clr_linenum(void)
+#define IDX_CHUNK (64 * 1024)        // Bytes per index entry
+#define IDX_READ (16 * IDX_CHUNK)    // Bytes read at a time
+#define IDX_MIN_WALK (1024 * 1024)   // Start indexing for a walk this long
+#define IDX_MIN_PART (4 * IDX_READ)  // Least a thread is given to count
+#define IDX_MAX_THREADS 8
+#define IDX_MAGIC "elessix2"         // First bytes of a saved index
+#define IDX_DIR "eless"              // Cache directory, under $XDG_CACHE_HOME
+#define IDX_KEEP_FILES 64            // Most saved indexes kept
+#define IDX_KEEP_BYTES (32 * 1024 * 1024) // Most bytes of saved indexes kept
+
+/*
+ * Header of a saved index; it is followed by the newline count
+ * of each chunk, and then by the name of the file (if known).
+ */
+struct idxheader {
+  char     magic[8];   // IDX_MAGIC
+  uint64_t chunk;      // IDX_CHUNK
+  uint64_t dev;        // Device of the file
+  uint64_t ino;        // Inode of the file
+  int64_t  size;       // Bytes indexed
+  int64_t  mtime;      // Modification time of the file, in ns
+  uint64_t hfirst;     // Hash of the first chunk
+  uint64_t hlast;      // Hash of the last chunk
+  uint64_t nchunks;    // Number of counts which follow
+  uint64_t namelen;    // Length of the name after the counts
+};
+
+struct lineindex {
+  std::atomic<bool>      ready{ false };  // before[] is complete
+  std::atomic<bool>      cancel{ false }; // Give up: the index is no longer wanted
+  std::atomic<bool>      failed{ false }; // A read failed
+  position_t             size = 0;        // Bytes indexed
+  bool                   partial = false; // The last line has no newline
+  std::vector<linenum_t> before;          // Newlines before each chunk, and in all
+};
+
+static std::shared_ptr<lineindex> lindex; // Index of the current file, if any
+static bool                       lindex_tried; // Don't try to index it again
+
+/*
+ * Count the newlines in the n bytes at p.
+ */
+static linenum_t count_newlines(const char* p, size_t n)
 {
-  struct linenum_info* p;
+  const char* end = p + n;
+  linenum_t   count = 0;
 
-  /*
-   * Put all the entries on the free list.
-   * Leave one for the "spare".
-   */
-  for (p = pool; p < &pool[NPOOL - 2]; p++)
-    p->next = p + 1;
-  pool[NPOOL - 2].next = NULL;
-  freelist             = pool;
+  while ((p = (const char*)memchr(p, '\n', end - p)) != NULL) {
+    count++;
+    p++;
+  }
+  return (count);
+}
 
-  spare = &pool[NPOOL - 1];
+/*
+ * Count the newlines in chunks k0 up to k1 of the file f into cnt.
+ */
+static void index_part(lineindex* ix, int f, size_t k0, size_t k1, linenum_t* cnt)
+{
+  std::vector<char> buf(IDX_READ);
 
-  /*
-   * Initialize the anchor.
-   */
-  anchor.next = anchor.prev = &anchor;
-  anchor.gap                = 0;
-  anchor.pos                = (position_t)0;
-  anchor.line               = 1;
+  for (size_t k = k0; k < k1 && !ix->cancel && !ix->failed;) {
+    position_t pos  = static_cast<position_t>(k) * IDX_CHUNK;
+    size_t     want = static_cast<size_t>(std::min<position_t>(
+        static_cast<position_t>(std::min<size_t>(k1 - k, IDX_READ / IDX_CHUNK)) * IDX_CHUNK, ix->size - pos));
+    ssize_t    n    = pread(f, buf.data(), want, pos);
+
+    if (n != static_cast<ssize_t>(want)) {
+      ix->failed = true;
+      return;
+    }
+    for (size_t off = 0; off < want; off += IDX_CHUNK)
+      cnt[k++] = count_newlines(&buf[off], std::min<size_t>(IDX_CHUNK, want - off));
+  }
+}
+
+/*
+ * Get the name of the directory where indexes are saved.
+ * Return an empty string if they aren't to be saved.
+ */
+static std::string index_dir(void)
+{
+  char* name;
+
+  /* See if the directory is explicitly specified by $LESSINDEXDIR. */
+  name = decode::lgetenv((char*)"LESSINDEXDIR");
+  if (!decode::isnullenv(name)) {
+    if (strcmp(name, "-") == 0)
+      /* $LESSINDEXDIR == "-" means don't save indexes. */
+      return ("");
+    return (name);
+  }
+  /* Otherwise, it is in $XDG_CACHE_HOME or $HOME/.cache. */
+  name = decode::lgetenv((char*)"XDG_CACHE_HOME");
+  if (!decode::isnullenv(name))
+    return (std::string(name) + "/" IDX_DIR);
+  name = decode::lgetenv((char*)"HOME");
+  if (!decode::isnullenv(name))
+    return (std::string(name) + "/.cache/" IDX_DIR);
+  return ("");
+}
+
+/*
+ * Hash the n bytes of the file f at pos (FNV-1a).
+ * Return 0 if they can't be read.
+ */
+static uint64_t index_hash(int f, position_t pos, size_t n)
+{
+  std::vector<unsigned char> buf(n);
+  uint64_t                   h = 14695981039346656037ULL;
+
+  if (pread(f, buf.data(), n, pos) != static_cast<ssize_t>(n))
+    return (0);
+  for (unsigned char c : buf)
+    h = (h ^ c) * 1099511628211ULL;
+  return (h | 1);
+}
+
+/*
+ * Hash the first and the last chunk of the first size bytes of f.
+ */
+static void index_hashes(int f, position_t size, uint64_t* hfirst, uint64_t* hlast)
+{
+  position_t last = (size - 1) / IDX_CHUNK * IDX_CHUNK;
+
+  *hfirst = index_hash(f, 0, static_cast<size_t>(std::min<position_t>(size, IDX_CHUNK)));
+  *hlast  = index_hash(f, last, static_cast<size_t>(size - last));
 }
 
 /*
- * Calculate the gap for an entry.
+ * Read the saved index of file f (whose status is st) into cnt.
+ * Return how many chunks it gave the count of: all of them if it is
+ * up to date, only the complete ones if the file has been appended
+ * to, and none if it isn't there or doesn't match.
  */
-static void calcgap(struct linenum_info* p)
+static size_t index_load(const std::string& name, int f, const struct stat& st, std::vector<linenum_t>& cnt)
 {
+  struct idxheader h;
+  uint64_t         hfirst;
+  uint64_t         hlast;
+  size_t           n;
+  int              fd;
+
+  if ((fd = open(name.c_str(), O_RDONLY)) < 0)
+    return (0);
+  n = 0;
+  if (read(fd, &h, sizeof(h)) == static_cast<ssize_t>(sizeof(h)) && memcmp(h.magic, IDX_MAGIC, sizeof(h.magic)) == 0
+      && h.chunk == IDX_CHUNK && h.dev == st.st_dev && h.ino == st.st_ino && h.size > 0
+      && h.size <= st.st_size && h.nchunks == static_cast<uint64_t>((h.size + IDX_CHUNK - 1) / IDX_CHUNK)) {
+    index_hashes(f, h.size, &hfirst, &hlast);
+    if (hfirst == h.hfirst && hlast == h.hlast) {
+      if (h.size == st.st_size)
+        n = (h.mtime == st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) ? h.nchunks : 0;
+      else
+        n = static_cast<size_t>(h.size / IDX_CHUNK);
+    }
+    n = std::min(n, cnt.size());
+    if (n > 0 && read(fd, cnt.data(), n * sizeof(linenum_t)) != static_cast<ssize_t>(n * sizeof(linenum_t)))
+      n = 0;
+  }
+  close(fd);
+  return (n);
+}
+
+/*
+ * Is the saved index name (whose status is st) still wanted?
+ * It isn't if the file it names is gone or is now another inode.
+ * An index which doesn't name its file is kept until it is old.
+ */
+static bool index_wanted(const std::string& name, const struct stat& st)
+{
+  struct idxheader h;
+  struct stat      fst;
+  int              fd;
+  bool             wanted = false;
+
+  if ((fd = open(name.c_str(), O_RDONLY)) < 0)
+    return (false);
+  if (read(fd, &h, sizeof(h)) == static_cast<ssize_t>(sizeof(h)) && memcmp(h.magic, IDX_MAGIC, sizeof(h.magic)) == 0
+      && h.namelen < PATH_MAX
+      && sizeof(h) + h.nchunks * sizeof(linenum_t) + h.namelen == static_cast<uint64_t>(st.st_size)) {
+    std::string fname(h.namelen, '\0');
+    if (h.namelen == 0)
+      wanted = true;
+    else if (pread(fd, &fname[0], h.namelen, sizeof(h) + h.nchunks * sizeof(linenum_t))
+             == static_cast<ssize_t>(h.namelen))
+      wanted = stat(fname.c_str(), &fst) == 0 && fst.st_dev == h.dev && fst.st_ino == h.ino;
+  }
+  close(fd);
+  return (wanted);
+}
+
+/*
+ * Prune the saved indexes in dir.  Remove those which are no longer
+ * wanted, and then the oldest until no more than IDX_KEEP_FILES
+ * are left, taking no more than IDX_KEEP_BYTES.
+ * Only names of the form <dev>-<ino> are touched.
+ */
+static void index_prune(const std::string& dir)
+{
+  struct saved {
+    std::string name;
+    time_t      mtime;
+    off_t       size;
+  };
+  std::vector<struct saved> kept;
+  struct dirent*            e;
+  struct stat               st;
+  DIR*                      d;
+  off_t                     total = 0;
+
+  if ((d = opendir(dir.c_str())) == nullptr)
+    return;
+  while ((e = readdir(d)) != nullptr) {
+    const char* p = e->d_name;
+    if (strspn(p, "0123456789") == 0)
+      continue;
+    p += strspn(p, "0123456789");
+    if (*p++ != '-' || strspn(p, "0123456789") == 0 || p[strspn(p, "0123456789")] != '\0')
+      continue;
+    std::string name = dir + "/" + e->d_name;
+    if (lstat(name.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+      continue;
+    if (!index_wanted(name, st))
+      (void)unlink(name.c_str());
+    else
+      kept.push_back({ name, st.st_mtime, st.st_size });
+  }
+  closedir(d);
+
   /*
-   * Don't bother to compute a gap for the anchor.
-   * Also don't compute a gap for the last one in the list.
-   * The gap for that last one should be considered infinite,
-   * but we never look at it anyway.
+   * Newest first; drop from the end.
    */
-  if (p == &anchor || p->next == &anchor)
+  std::sort(kept.begin(), kept.end(),
+            [](const struct saved& a, const struct saved& b) { return (a.mtime > b.mtime); });
+  for (size_t i = 0; i < kept.size(); i++) {
+    total += kept[i].size;
+    if (i >= IDX_KEEP_FILES || (i > 0 && total > IDX_KEEP_BYTES))
+      (void)unlink(kept[i].name.c_str());
+  }
+}
+
+/*
+ * Save the index of file f (whose status is st, and whose name is
+ * path, if known) from cnt, and prune the other indexes in dir.
+ * It is written to a temporary file and renamed, so a reader
+ * never sees half of it.
+ */
+static void index_save(const std::string& dir, const std::string& name, const std::string& path, int f,
+                       const struct stat& st, const std::vector<linenum_t>& cnt)
+{
+  struct idxheader h;
+  struct stat      pst;
+  std::string      tmp = name + ".XXXXXX";
+  size_t           n   = cnt.size() * sizeof(linenum_t);
+  int              fd;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, IDX_MAGIC, sizeof(h.magic));
+  h.chunk   = IDX_CHUNK;
+  h.dev     = st.st_dev;
+  h.ino     = st.st_ino;
+  h.size    = st.st_size;
+  h.mtime   = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  h.nchunks = cnt.size();
+  if (!path.empty() && stat(path.c_str(), &pst) == 0 && pst.st_dev == st.st_dev && pst.st_ino == st.st_ino)
+    h.namelen = path.size();
+  index_hashes(f, h.size, &h.hfirst, &h.hlast);
+  if (h.hfirst == 0 || h.hlast == 0)
     return;
-  p->gap = p->next->pos - p->prev->pos;
+
+  (void)mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0700);
+  (void)mkdir(dir.c_str(), 0700);
+  if ((fd = mkstemp(&tmp[0])) < 0)
+    return;
+  bool ok = write(fd, &h, sizeof(h)) == static_cast<ssize_t>(sizeof(h))
+            && write(fd, cnt.data(), n) == static_cast<ssize_t>(n)
+            && write(fd, path.data(), h.namelen) == static_cast<ssize_t>(h.namelen);
+  if (close(fd) < 0 || !ok || rename(tmp.c_str(), name.c_str()) < 0)
+    (void)unlink(tmp.c_str());
+  index_prune(dir);
 }
 
 /*
- * Add a new line number to the cache.
- * The specified position (pos) should be the file position of the
- * FIRST character in the specified line.
+ * Build the index of file f (whose status is st, and whose name is
+ * path), which is closed when we've finished.  dir is where the index
+ * is saved, if anywhere.
  */
-void add_lnum(linenum_t linenum, position_t pos)
+static void index_build(std::shared_ptr<lineindex> ix, int f, struct stat st, std::string dir, std::string path)
 {
-  struct linenum_info* p;
-  struct linenum_info* newLineNum;
-  struct linenum_info* nextp;
-  struct linenum_info* prevp;
-  position_t           mingap;
+  size_t                   nchunks  = static_cast<size_t>((ix->size + IDX_CHUNK - 1) / IDX_CHUNK);
+  size_t                   nthreads = std::thread::hardware_concurrency();
+  std::vector<linenum_t>   cnt(nchunks);
+  std::vector<std::thread> threads;
+  std::string              name;
+  size_t                   from = 0;
+  size_t                   per;
+  char                     c = '\n';
+
+  if (!dir.empty()) {
+    name = dir + "/" + std::to_string(st.st_dev) + "-" + std::to_string(st.st_ino);
+    from = index_load(name, f, st, cnt);
+  }
 
   /*
-   * Find the proper place in the list for the new one.
-   * The entries are sorted by position.
+   * Count the chunks we didn't get from the saved index.
    */
-  for (p = anchor.next; p != &anchor && p->pos < pos; p = p->next)
-    if (p->line == linenum)
-      /* We already have this one. */
-      return;
-  nextp = p;
-  prevp = p->prev;
+  nthreads = std::max<size_t>(1, std::min<size_t>(nthreads, IDX_MAX_THREADS));
+  nthreads = std::min<size_t>(nthreads, std::max<position_t>(1, (ix->size - from * IDX_CHUNK) / IDX_MIN_PART));
+  per      = (nchunks - from + nthreads - 1) / nthreads;
+  for (size_t t = 1; t < nthreads && from + t * per < nchunks; t++) {
+    size_t k0 = from + t * per;
+    size_t k1 = std::min(nchunks, k0 + per);
+    try {
+      threads.emplace_back(index_part, ix.get(), f, k0, k1, cnt.data());
+    } catch (const std::system_error&) {
+      /*
+       * Count this part ourselves.
+       */
+      index_part(ix.get(), f, k0, k1, cnt.data());
+    }
+  }
+  index_part(ix.get(), f, from, std::min(nchunks, from + per), cnt.data());
+  for (std::thread& t : threads)
+    t.join();
+  if (pread(f, &c, 1, ix->size - 1) != 1)
+    ix->failed = true;
+  ix->partial = (c != '\n');
+  if (ix->cancel || ix->failed) {
+    close(f);
+    return;
+  }
+
+  ix->before.resize(nchunks + 1);
+  ix->before[0] = 0;
+  for (size_t k = 0; k < nchunks; k++)
+    ix->before[k + 1] = ix->before[k] + cnt[k];
+  ix->ready = true;
+
+  /*
+   * The main thread may now extend the index, so it is not ours
+   * to look at any more.
+   */
+  if (!name.empty() && from < nchunks && st.st_size >= IDX_MIN_WALK)
+    index_save(dir, name, path, f, st, cnt);
+  close(f);
+}
 
-  if (freelist != NULL) {
+/*
+ * Start indexing the current file in the background, if we can.
+ * If saved_only, do it only if there is a saved index for it
+ * (which is cheap to load).
+ */
+static void index_start(bool saved_only)
+{
+  struct stat st;
+  std::string dir;
+  std::string path;
+  sigset_t    all;
+  sigset_t    old;
+  int         f;
+
+  if (lindex_tried)
+    return;
+  if ((f = ch::dupfile()) < 0) {
+    lindex_tried = true;
+    return;
+  }
+  if (fstat(f, &st) < 0 || !S_ISREG(st.st_mode) || (st.st_size < IDX_MIN_WALK && !less::Globals::ignore_eoi)) {
+    lindex_tried = true;
+    close(f);
+    return;
+  }
+  if (st.st_size == 0) {
     /*
-     * We still have free (unused) entries.
-     * Use one of them.
+     * Nothing to count yet; try again when it has grown.
      */
-    newLineNum = freelist;
-    freelist   = freelist->next;
-  } else {
+    close(f);
+    return;
+  }
+  dir = index_dir();
+  if (saved_only
+      && (dir.empty()
+          || access((dir + "/" + std::to_string(st.st_dev) + "-" + std::to_string(st.st_ino)).c_str(), R_OK) < 0)) {
+    close(f);
+    return;
+  }
+  lindex_tried                  = true;
+  std::shared_ptr<lineindex> ix = std::make_shared<lineindex>();
+  ix->size                      = st.st_size;
+  if (!dir.empty() && ifile::getCurrentIfile() != nullptr) {
+    char* rpath = filename::lrealpath(ifile::getCurrentIfile()->getFilename());
+    path        = rpath;
+    free(rpath);
+  }
+
+  /*
+   * Signals are blocked in the threads, so they are always
+   * delivered to the main thread (as for ch's read-ahead).
+   */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  try {
+    std::thread(index_build, ix, f, st, dir, path).detach();
+    lindex = ix;
+  } catch (const std::system_error&) {
+    close(f);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+/*
+ * Is the index ready to use, and does it cover pos?
+ */
+static bool index_covers(position_t pos)
+{
+  return (lindex != nullptr && lindex->ready && pos <= lindex->size);
+}
+
+/*
+ * Is the index ready to use, and does it cover the start of the line?
+ */
+static bool index_covers_line(linenum_t linenum)
+{
+  return (lindex != nullptr && lindex->ready && linenum - 1 <= lindex->before.back());
+}
+
+/*
+ * Count the newlines from pos (through the buffers), up to end or
+ * until want have been found, whichever is first.
+ * *endp is set to the position after the last char looked at.
+ * Return the number found, or -1 if the file can't be read there.
+ */
+static linenum_t scan_newlines(position_t pos, position_t end, linenum_t want, position_t* endp)
+{
+  const unsigned char* span;
+  linenum_t            count = 0;
+  int                  n;
+
+  if (ch::seek(pos))
+    return (-1);
+  while (pos < end && count < want) {
+    if ((n = ch::get_span(&span)) == 0)
+      return (-1);
+    if (n > end - pos)
+      n = static_cast<int>(end - pos);
+    const unsigned char* p = span;
+    const unsigned char* e = span + n;
+    while (count < want && (p = (const unsigned char*)memchr(p, '\n', e - p)) != NULL) {
+      count++;
+      p++;
+    }
+    pos += (count < want) ? n : (p - span);
+    if (ch::seek(pos))
+      return (-1);
+  }
+  *endp = pos;
+  return (count);
+}
+
+/*
+ * Forget the index, and let it be built again.
+ */
+static void index_drop(void)
+{
+  if (lindex != nullptr)
+    lindex->cancel = true;
+  lindex       = nullptr;
+  lindex_tried = false;
+}
+
+/*
+ * The file has grown past the end of the index: extend it to pos.
+ * The new part is counted through the buffers, which have just read
+ * it anyway; if there is a lot of it, the file is indexed again in
+ * the background instead (which counts only the new part if the index
+ * was saved).  If the file has shrunk, the index is no good any more.
+ */
+static void index_extend(position_t pos)
+{
+  position_t len = ch::length();
+  position_t next;
+  linenum_t  n;
+  int        c;
+
+  if (len != NULL_POSITION && len < lindex->size) {
+    index_drop();
+    return;
+  }
+  if (pos - lindex->size > IDX_MIN_WALK) {
+    index_drop();
+    index_start(false);
+    return;
+  }
+  while (lindex->size < pos) {
     /*
-     * No free entries.
-     * Use the "spare" entry.
+     * before.back() is the number of newlines before size;
+     * start a new chunk if size is at a chunk boundary.
      */
-    newLineNum = spare;
-    spare      = NULL;
+    if (lindex->size % IDX_CHUNK == 0)
+      lindex->before.push_back(lindex->before.back());
+    next = std::min<position_t>(pos, (lindex->size / IDX_CHUNK + 1) * IDX_CHUNK);
+    if ((n = scan_newlines(lindex->size, next, next - lindex->size, &next)) < 0)
+      break;
+    lindex->before.back() += n;
+    lindex->size = next;
   }
+  if (ch::seek(lindex->size - 1) == 0 && (c = ch::forw_get()) != EOI)
+    lindex->partial = (c != '\n');
+}
+
+/*
+ * Add a line number to the cache, unless pos is in the middle of
+ * the line (as at the end of a file which is still being written).
+ */
+static void cache_lnum(linenum_t linenum, position_t pos)
+{
+  if (ch::seek(pos - 1) == 0 && ch::forw_get() == '\n')
+    add_lnum(linenum, pos);
+}
+
+/*
+ * Find the line number of pos with the index.
+ * Return 0 if the index can't tell us.
+ */
+static linenum_t index_linenum(position_t pos)
+{
+  position_t cpos;
+  linenum_t  n;
+
+  if (lindex != nullptr && lindex->ready && pos > lindex->size)
+    index_extend(pos);
+  if (!index_covers(pos))
+    return (0);
+  size_t k = static_cast<size_t>(pos / IDX_CHUNK);
+  cpos     = static_cast<position_t>(k) * IDX_CHUNK;
+  if ((n = scan_newlines(cpos, pos, pos - cpos, &cpos)) < 0)
+    return (0);
+  /*
+   * Like the walk, count an unterminated last line as a line.
+   */
+  if (pos == lindex->size && lindex->partial)
+    n++;
+  return (1 + lindex->before[k] + n);
+}
 
+/*
+ * Find the position of the start of a line with the index.
+ * Return NULL_POSITION if the index can't tell us.
+ */
+static position_t index_pos(linenum_t linenum)
+{
+  position_t cpos;
+  linenum_t  want = linenum - 1; // Newlines before the line
+
+  if (!index_covers_line(linenum))
+    return (NULL_POSITION);
   /*
-   * Fill in the fields of the new entry,
-   * and insert it into the proper place in the list.
+   * Find the chunk holding the newline which ends the previous line.
    */
-  newLineNum->next = nextp;
-  newLineNum->prev = prevp;
-  newLineNum->pos  = pos;
-  newLineNum->line = linenum;
+  size_t k = std::lower_bound(lindex->before.begin(), lindex->before.end(), want) - lindex->before.begin() - 1;
+  want -= lindex->before[k];
+  if (scan_newlines(static_cast<position_t>(k) * IDX_CHUNK, lindex->size, want, &cpos) != want
+      || cpos >= lindex->size)
+    return (NULL_POSITION);
+  return (cpos);
+}
 
-  nextp->prev = newLineNum;
-  prevp->next = newLineNum;
+/*
+ * Initialize the line number structures.
+ */
+void clr_linenum(void)
+{
+  /*
+   * Forget the newline index.
+   */
+  index_drop();
+  index_start(true);
 
   /*
-   * Recalculate gaps for the newLineNum entry and the neighboring entries.
+   * Empty the table, except for the beginning of the file.
    */
-  calcgap(newLineNum);
-  calcgap(nextp);
-  calcgap(prevp);
+  lnums.clear();
+  lnums.push_back({ ch_zero, 1 });
+}
 
-  if (spare == NULL) {
-    /*
-     * We have used the spare entry.
-     * Scan the list to find the one with the smallest
-     * gap, take it out and make it the spare.
-     * We should never remove the last one, so stop when
-     * we get to p->next == &anchor.  This also avoids
-     * looking at the gap of the last one, which is
-     * not computed by calcgap.
-     */
-    mingap = anchor.next->gap;
-    for (p = anchor.next; p->next != &anchor; p = p->next) {
-      if (p->gap <= mingap) {
-        spare  = p;
-        mingap = p->gap;
-      }
-    }
-    if (spare != NULL) {
-      spare->next->prev = spare->prev;
-      spare->prev->next = spare->next;
-    } else {
-      output::error((char*)"Error spare null pointer", NULL_PARG);
-      utils::quit(QUIT_ERROR);
+/*
+ * How many entries the table may hold, given the size of the file.
+ */
+static size_t lnum_capacity(void)
+{
+  position_t len = ch::length();
+
+  if (len == NULL_POSITION)
+    len = lnums.back().pos;
+  return (static_cast<size_t>(std::max<position_t>(LNUM_MIN, std::min<position_t>(LNUM_MAX, len / LNUM_SPACING))));
+}
+
+/*
+ * The table is full: throw away the least interesting entries.
+ * Never remove the first or the last one.
+ */
+static void lnum_evict(size_t cap, position_t near)
+{
+  size_t              n = lnums.size();
+  size_t              nevict;
+  std::vector<double> score(n);
+  std::vector<double> sorted;
+  double              limit;
+  size_t              i;
+  size_t              j;
+
+  if (n < 3)
+    return;
+  nevict = std::min(n - 2, n - cap + cap / LNUM_EVICT);
+  for (i = 1; i < n - 1; i++) {
+    position_t gap  = lnums[i + 1].pos - lnums[i - 1].pos;
+    position_t dist = (lnums[i].pos > near) ? lnums[i].pos - near : near - lnums[i].pos;
+    score[i]        = static_cast<double>(gap) / (1.0 + static_cast<double>(dist) / LNUM_NEAR);
+  }
+  sorted.assign(score.begin() + 1, score.end() - 1);
+  std::nth_element(sorted.begin(), sorted.begin() + (nevict - 1), sorted.end());
+  limit = sorted[nevict - 1];
+
+  /*
+   * Remove the entries scoring no more than the limit.  Keep an
+   * entry whose previous neighbour has just gone, since its gap
+   * is now bigger than the one we scored it by.
+   */
+  bool removed = false;
+  for (i = j = 1; i < n - 1; i++) {
+    if (nevict > 0 && !removed && score[i] <= limit) {
+      nevict--;
+      removed = true;
+      continue;
     }
+    removed    = false;
+    lnums[j++] = lnums[i];
+  }
+  lnums[j++] = lnums[n - 1];
+  lnums.resize(j);
+}
+
+/*
+ * Add a new line number to the cache.
+ * The specified position (pos) should be the file position of the
+ * FIRST character in the specified line.
+ */
+void add_lnum(linenum_t linenum, position_t pos)
+{
+  std::vector<struct linenum_info>::iterator p;
+  size_t                                     cap;
+  position_t                                 near;
+
+  /*
+   * Find the proper place in the table for the new one.
+   */
+  p = std::lower_bound(lnums.begin(), lnums.end(), pos,
+                       [](const struct linenum_info& e, position_t x) { return (e.pos < x); });
+  if ((p != lnums.end() && p->pos == pos) || p[-1].line == linenum)
+    /* We already have this one. */
+    return;
+  lnums.insert(p, { pos, linenum });
+
+  if (lnums.size() > (cap = lnum_capacity())) {
+    if ((near = position::position(TOP)) == NULL_POSITION)
+      near = pos;
+    lnum_evict(cap, near);
   }
 }
 
@@ -250,9 +854,12 @@ static void abort_long(void)
  */
 linenum_t find_linenum(position_t pos)
 {
-  struct linenum_info* p;
+  std::vector<struct linenum_info>::iterator p;
+  struct linenum_info                        from;
   linenum_t            linenum;
+  linenum_t            n;
   position_t           cpos;
+  bool                 forward;
 
   if (!linenums)
     /*
@@ -273,9 +880,9 @@ linenum_t find_linenum(position_t pos)
   /*
    * Find the entry nearest to the position we want.
    */
-  for (p = anchor.next; p != &anchor && p->pos < pos; p = p->next)
-    continue;
-  if (p->pos == pos)
+  p = std::lower_bound(lnums.begin(), lnums.end(), pos,
+                       [](const struct linenum_info& e, position_t x) { return (e.pos < x); });
+  if (p != lnums.end() && p->pos == pos)
     /* Found it exactly. */
     return (p->line);
 
@@ -291,15 +898,22 @@ linenum_t find_linenum(position_t pos)
    * traversing fewer bytes in the file.
    */
   startime = os::get_time();
-  if (p == &anchor || pos - p->prev->pos < p->pos - pos) {
+  forward  = (p == lnums.end() || pos - p[-1].pos < p->pos - pos);
+  from     = forward ? p[-1] : *p;
+  if ((forward ? pos - from.pos : from.pos - pos) > IDX_MIN_WALK || less::Globals::ignore_eoi)
+    index_start(false);
+  if ((linenum = index_linenum(pos)) != 0) {
+    cache_lnum(linenum, pos);
+    return (linenum);
+  }
+  if (forward) {
     /*
      * Go forward.
      */
-    p = p->prev;
-    if (ch::seek(p->pos))
+    if (ch::seek(from.pos))
       return (0);
     loopcount = 0;
-    for (linenum = p->line, cpos = p->pos; cpos < pos; linenum++) {
+    for (linenum = from.line, cpos = from.pos; cpos < pos; linenum++) {
       /*
        * Allow a signal to abort this loop.
        */
@@ -311,11 +925,15 @@ linenum_t find_linenum(position_t pos)
       if (cpos == NULL_POSITION)
         return (0);
       longish();
+      if ((linenum & 0xff) == 0 && (n = index_linenum(pos)) != 0) {
+        cache_lnum(n, pos);
+        return (n);
+      }
     }
     /*
      * We might as well cache it.
      */
-    add_lnum(linenum, cpos);
+    cache_lnum(linenum, cpos);
     /*
      * If the given position is not at the start of a line,
      * make sure we return the correct line number.
@@ -326,10 +944,10 @@ linenum_t find_linenum(position_t pos)
     /*
      * Go backward.
      */
-    if (ch::seek(p->pos))
+    if (ch::seek(from.pos))
       return (0);
     loopcount = 0;
-    for (linenum = p->line, cpos = p->pos; cpos > pos; linenum--) {
+    for (linenum = from.line, cpos = from.pos; cpos > pos; linenum--) {
       /*
        * Allow a signal to abort this loop.
        */
@@ -341,6 +959,10 @@ linenum_t find_linenum(position_t pos)
       if (cpos == NULL_POSITION)
         return (0);
       longish();
+      if ((linenum & 0xff) == 0 && (n = index_linenum(pos)) != 0) {
+        cache_lnum(n, pos);
+        return (n);
+      }
     }
     /*
      * We might as well cache it.
@@ -357,9 +979,12 @@ linenum_t find_linenum(position_t pos)
  */
 position_t find_pos(linenum_t linenum)
 {
-  struct linenum_info* p;
+  std::vector<struct linenum_info>::iterator p;
+  struct linenum_info                        from;
   position_t           cpos;
+  position_t           xpos;
   linenum_t            clinenum;
+  bool                 forward;
 
   if (linenum <= 1)
     /*
@@ -370,20 +995,27 @@ position_t find_pos(linenum_t linenum)
   /*
    * Find the entry nearest to the line number we want.
    */
-  for (p = anchor.next; p != &anchor && p->line < linenum; p = p->next)
-    continue;
-  if (p->line == linenum)
+  p = std::lower_bound(lnums.begin(), lnums.end(), linenum,
+                       [](const struct linenum_info& e, linenum_t x) { return (e.line < x); });
+  if (p != lnums.end() && p->line == linenum)
     /* Found it exactly. */
     return (p->pos);
 
-  if (p == &anchor || linenum - p->prev->line < p->line - linenum) {
+  forward = (p == lnums.end() || linenum - p[-1].line < p->line - linenum);
+  if (p == lnums.end() || p->pos - p[-1].pos > IDX_MIN_WALK)
+    index_start(false);
+  from = forward ? p[-1] : *p;
+  if ((cpos = index_pos(linenum)) != NULL_POSITION) {
+    add_lnum(linenum, cpos);
+    return (cpos);
+  }
+  if (forward) {
     /*
      * Go forward.
      */
-    p = p->prev;
-    if (ch::seek(p->pos))
+    if (ch::seek(from.pos))
       return (NULL_POSITION);
-    for (clinenum = p->line, cpos = p->pos; clinenum < linenum; clinenum++) {
+    for (clinenum = from.line, cpos = from.pos; clinenum < linenum; clinenum++) {
       /*
        * Allow a signal to abort this loop.
        */
@@ -392,14 +1024,18 @@ position_t find_pos(linenum_t linenum)
         return (NULL_POSITION);
       if (cpos == NULL_POSITION)
         return (NULL_POSITION);
+      if ((clinenum & 0xff) == 0 && (xpos = index_pos(linenum)) != NULL_POSITION) {
+        add_lnum(linenum, xpos);
+        return (xpos);
+      }
     }
   } else {
     /*
      * Go backward.
      */
-    if (ch::seek(p->pos))
+    if (ch::seek(from.pos))
       return (NULL_POSITION);
-    for (clinenum = p->line, cpos = p->pos; clinenum > linenum; clinenum--) {
+    for (clinenum = from.line, cpos = from.pos; clinenum > linenum; clinenum--) {
       /*
        * Allow a signal to abort this loop.
        */
@@ -408,6 +1044,10 @@ position_t find_pos(linenum_t linenum)
         return (NULL_POSITION);
       if (cpos == NULL_POSITION)
         return (NULL_POSITION);
+      if ((clinenum & 0xff) == 0 && (xpos = index_pos(linenum)) != NULL_POSITION) {
+        add_lnum(linenum, xpos);
+        return (xpos);
+      }
     }
   }
   /*
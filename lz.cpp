@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 1984-2020  Mark Nudelman
+ *
+ * You may distribute under the terms of either the GNU General Public
+ * License or the Less License, as specified in the README file.
+ *
+ * For more information, see the README file.
+ */
+
+/*
+ * A small LZ77 block compressor in the style of LZ4.
+ *
+ * A compressed block is a series of sequences.  Each sequence is
+ * a token byte, whose high four bits are the number of literal bytes
+ * and whose low four bits are the length of the match minus MINMATCH,
+ * then the literal bytes, then the two-byte (little endian) offset
+ * back to the start of the match.  A length of 15 in the token is
+ * continued in following bytes: each byte is added to it, and a
+ * byte of 255 means another byte follows.  The match length follows
+ * the literals; the last sequence has only literals.
+ *
+ * This is not meant to compress well, only quickly: text usually
+ * shrinks to a fifth or less of its size.
+ */
+
+#include "lz.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace lz {
+
+namespace {
+  constexpr int MINMATCH  = 4;       /* Shortest match worth encoding */
+  constexpr int LASTLITS  = 5;       /* Bytes at the end always sent as literals */
+  constexpr int MAXOFFSET = 65535;   /* Farthest a match may be */
+  constexpr int HASHBITS  = 13;      /* log2 of the size of the match table */
+
+  inline uint32_t read32(const unsigned char* p)
+  {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v);
+  }
+
+  inline unsigned int hash(uint32_t v)
+  {
+    return ((v * 2654435761u) >> (32 - HASHBITS));
+  }
+
+  /*
+   * Write the continuation bytes of a length of at least 15.
+   */
+  inline unsigned char* put_length(unsigned char* op, int n)
+  {
+    for (n -= 15; n >= 255; n -= 255)
+      *op++ = 255;
+    *op++ = (unsigned char)n;
+    return (op);
+  }
+
+  /*
+   * Read the continuation bytes of a length; return false if the
+   * input runs out.
+   */
+  inline bool get_length(const unsigned char** ipp, const unsigned char* iend, int* np)
+  {
+    const unsigned char* ip = *ipp;
+    int                  c;
+
+    do {
+      if (ip >= iend)
+        return (false);
+      c = *ip++;
+      *np += c;
+    } while (c == 255);
+    *ipp = ip;
+    return (true);
+  }
+} // namespace
+
+/*
+ * The most a block of len bytes can grow to when compressed.
+ */
+int bound(int len)
+{
+  return (len + len / 255 + 16);
+}
+
+/*
+ * Compress len bytes at src into dst, which has room for cap bytes.
+ * Return the compressed size, or 0 if it doesn't fit.
+ */
+int compress(const unsigned char* src, int len, unsigned char* dst, int cap)
+{
+  static int32_t       table[1 << HASHBITS];
+  const unsigned char* ip     = src;
+  const unsigned char* anchor = src;
+  const unsigned char* iend   = src + len;
+  int                  ilimit = len - LASTLITS - MINMATCH;
+  unsigned char*       op     = dst;
+  unsigned char*       oend   = dst + cap;
+
+  for (auto& t : table)
+    t = -MAXOFFSET - 1;
+
+  while (ip - src <= ilimit) {
+    uint32_t     v    = read32(ip);
+    unsigned int h    = hash(v);
+    int32_t      pos  = (int32_t)(ip - src);
+    int32_t      prev = table[h];
+
+    table[h] = pos;
+    if (pos - prev > MAXOFFSET || read32(src + prev) != v) {
+      ip++;
+      continue;
+    }
+    const unsigned char* ref = src + prev;
+
+    /*
+     * Found a match: extend it as far as it goes.
+     */
+    const unsigned char* mend = ip + MINMATCH;
+    const unsigned char* r    = ref + MINMATCH;
+    while (mend < iend - LASTLITS && *mend == *r) {
+      mend++;
+      r++;
+    }
+    int nlit   = (int)(ip - anchor);
+    int nmatch = (int)(mend - ip) - MINMATCH;
+
+    if (op + 1 + nlit + nlit / 255 + 1 + 2 + nmatch / 255 + 1 > oend)
+      return (0);
+    unsigned char* token = op++;
+    *token = (unsigned char)(((nlit < 15) ? nlit : 15) << 4);
+    if (nlit >= 15)
+      op = put_length(op, nlit);
+    memcpy(op, anchor, nlit);
+    op += nlit;
+    *op++ = (unsigned char)((ip - ref) & 0xff);
+    *op++ = (unsigned char)((ip - ref) >> 8);
+    *token |= (unsigned char)((nmatch < 15) ? nmatch : 15);
+    if (nmatch >= 15)
+      op = put_length(op, nmatch);
+    ip = anchor = mend;
+  }
+
+  /*
+   * The rest goes as literals.
+   */
+  int nlit = (int)(iend - anchor);
+  if (op + 1 + nlit + nlit / 255 + 1 > oend)
+    return (0);
+  *op++ = (unsigned char)(((nlit < 15) ? nlit : 15) << 4);
+  if (nlit >= 15)
+    op = put_length(op, nlit);
+  memcpy(op, anchor, nlit);
+  op += nlit;
+  return ((int)(op - dst));
+}
+
+/*
+ * Decompress len bytes at src into dst, which has room for cap bytes.
+ * Return the decompressed size, or -1 if the data is corrupt.
+ */
+int decompress(const unsigned char* src, int len, unsigned char* dst, int cap)
+{
+  const unsigned char* ip   = src;
+  const unsigned char* iend = src + len;
+  unsigned char*       op   = dst;
+  unsigned char*       oend = dst + cap;
+
+  while (ip < iend) {
+    int token = *ip++;
+    int nlit  = token >> 4;
+
+    if (nlit == 15 && !get_length(&ip, iend, &nlit))
+      return (-1);
+    if (nlit > iend - ip || nlit > oend - op)
+      return (-1);
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip >= iend)
+      break; /* The last sequence has no match. */
+
+    if (iend - ip < 2)
+      return (-1);
+    int off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    int nmatch = token & 15;
+    if (nmatch == 15 && !get_length(&ip, iend, &nmatch))
+      return (-1);
+    nmatch += MINMATCH;
+    if (off == 0 || off > op - dst || nmatch > oend - op)
+      return (-1);
+
+    /*
+     * The match may overlap what it is copying (a run),
+     * so copy it a byte at a time unless it is far enough back.
+     */
+    const unsigned char* ref = op - off;
+    if (off >= nmatch)
+      memcpy(op, ref, nmatch);
+    else
+      for (int i = 0; i < nmatch; i++)
+        op[i] = ref[i];
+    op += nmatch;
+  }
+  return ((int)(op - dst));
+}
+
+}; // namespace lz
@@ -0,0 +1,16 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+ * A small, fast LZ77 block compressor, used to keep cold
+ * blocks of pipe input in memory in compressed form.
+ */
+
+namespace lz {
+
+int bound(int len);
+int compress(const unsigned char* src, int len, unsigned char* dst, int cap);
+int decompress(const unsigned char* src, int len, unsigned char* dst, int cap);
+
+}; // namespace lz
+#endif
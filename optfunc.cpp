@@ -30,6 +30,7 @@
 #include "decode.hpp"
 #include "edit.hpp"
 #include "filename.hpp"
+#include "input.hpp"
 #include "jump.hpp"
 #include "less.hpp"
 #include "option.hpp"
@@ -627,6 +628,98 @@ void opt_wheel_lines(int type, char* s)
   }
 }
 
+/*
+ * Handler for the --spill-dir option.
+ */
+void opt_spill_dir(int type, char* s)
+{
+  parg_t parg;
+
+  switch (type) {
+  case option::INIT:
+  case option::TOGGLE:
+    s = utils::skipsp(s);
+    free(less::Globals::spill_dir);
+    less::Globals::spill_dir = (*s == '\0') ? NULL : utils::save(s);
+    break;
+  case option::QUERY:
+    if (less::Globals::spill_dir == NULL)
+      output::error((char*)"Spill files are created in $TMPDIR or /tmp", NULL_PARG);
+    else {
+      parg.p_string = less::Globals::spill_dir;
+      output::error((char*)"Spill files are created in \"%s\"", parg);
+    }
+    break;
+  }
+}
+
+/*
+ * Handler for the --show-compression option.
+ */
+void opt_show_compression(int type, char* s)
+{
+  const ch::zstats& zs = ch::compress_stats();
+  char              buf[200];
+  parg_t            parg;
+
+  switch (type) {
+  case option::TOGGLE:
+  case option::QUERY:
+    snprintf(buf, sizeof(buf),
+        "%ld blocks compressed, %ld decompressed; %ld held in %lldK (%lldK raw, %.1f:1)",
+        zs.compressed, zs.decompressed, zs.held,
+        (long long)(zs.zbytes / 1024), (long long)(zs.rawbytes / 1024),
+        (zs.zbytes > 0) ? (double)zs.rawbytes / zs.zbytes : 0.0);
+    parg.p_string = buf;
+    output::error((char*)"%s", parg);
+    break;
+  }
+}
+
+/*
+ * Handler for the --show-buffers option.
+ */
+void opt_show_buffers(int type, char* s)
+{
+  const ch::allocstats& as = ch::alloc_stats();
+  char                  buf[200];
+  parg_t                parg;
+
+  switch (type) {
+  case option::TOGGLE:
+  case option::QUERY:
+    snprintf(buf, sizeof(buf),
+        "%ld buffers, %ld free; %ld slabs (%ld huge) of %lldK; %ld slabs allocated, %ld freed",
+        as.bufs, as.freebufs, as.slabs, as.hugeslabs, (long long)(as.slabbytes / 1024),
+        as.slaballocs, as.slabfrees);
+    parg.p_string = buf;
+    output::error((char*)"%s", parg);
+    break;
+  }
+}
+
+/*
+ * Handler for the --show-line-cache option.
+ */
+void opt_show_line_cache(int type, char* s)
+{
+  const input::linecache_stats& ls = input::line_cache_stats();
+  char                          buf[200];
+  parg_t                        parg;
+
+  switch (type) {
+  case option::TOGGLE:
+  case option::QUERY:
+    snprintf(buf, sizeof(buf),
+        "%ld lines found in cache, %ld rendered (%.0f%% hits); %ld lines held, cache cleared %ld times",
+        ls.hits, ls.misses, (ls.hits + ls.misses > 0) ? 100.0 * ls.hits / (ls.hits + ls.misses) : 0.0,
+        ls.held, ls.flushes);
+    parg.p_string = buf;
+    output::error((char*)"%s", parg);
+    break;
+  }
+}
+
 /*
  * Get the "screen window" size.
  */
@@ -42,6 +42,10 @@ void opt_rscroll(int type, char* s);
 void opt_query(int type, char* s);
 void opt_mousecap(int type, char* s);
 void opt_wheel_lines(int type, char* s);
+void opt_spill_dir(int type, char* s);
+void opt_show_compression(int type, char* s);
+void opt_show_buffers(int type, char* s);
+void opt_show_line_cache(int type, char* s);
 int  get_swindow(void);
 
 } // namespace optfunc
@@ -126,6 +126,19 @@ static struct optname nohistdups_optname    = { (char*)"no-histdups", NULL };
 static struct optname mousecap_optname      = { (char*)"mouse", NULL };
 static struct optname wheel_lines_optname   = { (char*)"wheel-lines", NULL };
 static struct optname perma_marks_optname   = { (char*)"save-marks", NULL };
+static struct optname mmap_optname          = { (char*)"mmap", NULL };
+static struct optname read_ahead_optname    = { (char*)"read-ahead", NULL };
+static struct optname block_size_optname    = { (char*)"block-size", NULL };
+static struct optname cache_size_optname    = { (char*)"cache-size", NULL };
+static struct optname spill_optname         = { (char*)"spill", NULL };
+static struct optname spill_dir_optname     = { (char*)"spill-dir", NULL };
+static struct optname compress_optname      = { (char*)"compress", NULL };
+static struct optname show_compression_optname = { (char*)"show-compression", NULL };
+static struct optname huge_pages_optname    = { (char*)"huge-pages", NULL };
+static struct optname show_buffers_optname  = { (char*)"show-buffers", NULL };
+static struct optname show_line_cache_optname = { (char*)"show-line-cache", NULL };
+static struct optname fadvise_optname       = { (char*)"fadvise", NULL };
+static struct optname direct_io_optname     = { (char*)"direct-io", NULL };
 // clang-format on
 
 /*
@@ -395,6 +408,71 @@ static struct option::loption option[] = {
       { (char*)"Don't save marks in history file",
           (char*)"Save marks in history file",
           NULL } },
+  { OLETTER_NONE, &mmap_optname,
+      BOOL, OPT_OFF, &less::Globals::use_mmap, NULL,
+      { (char*)"Read files into buffers",
+          (char*)"Memory-map regular files",
+          NULL } },
+  { OLETTER_NONE, &read_ahead_optname,
+      NUMBER, 0, &less::Globals::read_ahead, NULL,
+      { (char*)"Blocks to read ahead: ",
+          (char*)"Read ahead %d block(s)",
+          NULL } },
+  { OLETTER_NONE, &block_size_optname,
+      NUMBER, 0, &less::Globals::block_size, NULL,
+      { (char*)"Block size (K): ",
+          (char*)"Block size %dK (0 = automatic)",
+          NULL } },
+  { OLETTER_NONE, &cache_size_optname,
+      NUMBER, 65536, &less::Globals::cache_size, NULL,
+      { (char*)"Block cache size (K): ",
+          (char*)"Block cache size %dK (-1 = no limit)",
+          NULL } },
+  { OLETTER_NONE, &spill_optname,
+      BOOL, OPT_OFF, &less::Globals::spill, NULL,
+      { (char*)"Keep all pipe input in memory",
+          (char*)"Spill pipe input to a file beyond the buffer limit",
+          NULL } },
+  { OLETTER_NONE, &spill_dir_optname,
+      STRING, 0, NULL, optfunc::opt_spill_dir,
+      { (char*)"Spill directory: ",
+          NULL,
+          NULL } },
+  { OLETTER_NONE, &compress_optname,
+      BOOL, OPT_OFF, &less::Globals::compress, NULL,
+      { (char*)"Keep all pipe input in memory",
+          (char*)"Compress pipe input beyond the buffer limit",
+          NULL } },
+  { OLETTER_NONE, &show_compression_optname,
+      NOVAR, 0, NULL, optfunc::opt_show_compression,
+      { NULL,
+          NULL,
+          NULL } },
+  { OLETTER_NONE, &huge_pages_optname,
+      BOOL, OPT_OFF, &less::Globals::huge_pages, NULL,
+      { (char*)"Use normal pages for buffers",
+          (char*)"Use huge pages for buffers",
+          NULL } },
+  { OLETTER_NONE, &show_buffers_optname,
+      NOVAR, 0, NULL, optfunc::opt_show_buffers,
+      { NULL,
+          NULL,
+          NULL } },
+  { OLETTER_NONE, &show_line_cache_optname,
+      NOVAR, 0, NULL, optfunc::opt_show_line_cache,
+      { NULL,
+          NULL,
+          NULL } },
+  { OLETTER_NONE, &fadvise_optname,
+      BOOL, OPT_OFF, &less::Globals::fadvise, NULL,
+      { (char*)"Leave the page cache alone",
+          (char*)"Keep page cache use down",
+          NULL } },
+  { OLETTER_NONE, &direct_io_optname,
+      BOOL, OPT_OFF, &less::Globals::direct_io, NULL,
+      { (char*)"Read files through the page cache",
+          (char*)"Read files with direct I/O",
+          NULL } },
   { '\0', NULL,
       NOVAR, 0, NULL, NULL,
       { NULL,
@@ -27,6 +27,7 @@
 #include <csetjmp>
 #include <csignal>
 #include <ctime>
+#include <sys/uio.h>
 #if HAVE_ERRNO_H
 #include <cerrno>
 #endif
@@ -51,13 +52,14 @@ static jmp_buf read_label;
 namespace os {
 
 /*
- * Like read() system call, but is deliberately interruptible.
+ * Like readv() system call, or preadv() if pos is not NULL_POSITION,
+ * but is deliberately interruptible.
  * A call to intread() from a signal handler will interrupt
  * any pending iread().
  */
-int iread(int fd, unsigned char* buf, unsigned int len)
+static int ireadv(int fd, const struct iovec* iov, int iovcnt, position_t pos)
 {
-  int n;
+  ssize_t n;
 
 start:
   if (SET_JUMP(read_label)) {
@@ -81,7 +83,10 @@ start:
 
   output::flush();
   reading = 1;
-  n       = read(fd, buf, len);
+  if (pos == NULL_POSITION)
+    n = readv(fd, iov, iovcnt);
+  else
+    n = preadv(fd, iov, iovcnt, pos);
 #if 1
   /*
    * This is a kludge to workaround a problem on some systems
@@ -120,7 +125,28 @@ start:
 #endif
     return (-1);
   }
-  return (n);
+  return (static_cast<int>(n));
+}
+
+/*
+ * Like read() system call, but is deliberately interruptible.
+ */
+int iread(int fd, unsigned char* buf, unsigned int len)
+{
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len  = len;
+  return (ireadv(fd, &iov, 1, NULL_POSITION));
+}
+
+/*
+ * Read at file offset pos into several buffers, without moving the
+ * file offset, like preadv(); interruptible like iread().
+ */
+int ipreadv(int fd, const struct iovec* iov, int iovcnt, position_t pos)
+{
+  return (ireadv(fd, iov, iovcnt, pos));
 }
 
 /*
@@ -3,9 +3,12 @@
 
 #include "less.hpp"
 
+#include <sys/uio.h>
+
 namespace os {
     
 int        iread(int fd, unsigned char* buf, unsigned int len);
+int        ipreadv(int fd, const struct iovec* iov, int iovcnt, position_t pos);
 void       intread(void);
 time_t     get_time(void);
 char*      errno_message(char* filename);
@@ -54,6 +54,9 @@ static position_t prep_startpos;
 static position_t prep_endpos;
 static int        is_caseless;
 static int        is_ucase_pattern;
+static long       hilite_clears;                    /* Times the hilite lists have been cleared */
+static position_t added_startpos = NULL_POSITION;   /* Range of the hilites added */
+static position_t added_endpos   = NULL_POSITION;   /* since hilite_added was called */
 
 namespace search {
 /*
@@ -359,6 +362,7 @@ void clr_hlist(struct hilite_tree* anchor)
   anchor->lookaside = NULL;
 
   prep_startpos = prep_endpos = NULL_POSITION;
+  hilite_clears++;
 }
 
 void clr_hilite(void)
@@ -583,6 +587,59 @@ int is_hilited(position_t pos, position_t epos, int nohide, int* p_matches)
   return (1);
 }
 
+/*
+ * Is pos highlighted, as is_hilited(pos, pos+1, 0, ...) would say?
+ * Also set *lop and *hip to a range of positions around pos which are
+ * all highlighted or all not, so that a caller stepping through a line
+ * need only ask again when it steps out of the range.
+ * *hip is NULL_POSITION if the range runs on to the end of the file.
+ */
+bool hilite_run(position_t pos, position_t* lop, position_t* hip)
+{
+  struct hilite_node* n;
+  position_t          lo = 0;
+  position_t          hi = NULL_POSITION;
+
+  if (!status_col && start_attnpos != NULL_POSITION) {
+    if (pos >= start_attnpos && pos < end_attnpos) {
+      /*
+       * The whole attn line is highlighted.
+       */
+      *lop = start_attnpos;
+      *hip = end_attnpos;
+      return (true);
+    }
+    if (pos < start_attnpos)
+      hi = start_attnpos;
+    else
+      lo = end_attnpos;
+  }
+
+  *lop = lo;
+  *hip = hi;
+  if (hilite_search == 0 || hide_hilite)
+    return (false);
+
+  n = hlist_find(&hilite_anchor, pos);
+  if (n != NULL && pos >= n->r.hl_startpos) {
+    *lop = MAXPOS(lo, n->r.hl_startpos);
+    *hip = (hi == NULL_POSITION) ? n->r.hl_endpos : MINPOS(hi, n->r.hl_endpos);
+    return (true);
+  }
+  /*
+   * pos is between n->prev and n.  If there is no n, we don't
+   * know where the last highlight ends, so start from pos.
+   */
+  if (n == NULL)
+    *lop = pos;
+  else {
+    if (n->prev != NULL)
+      *lop = MAXPOS(lo, n->prev->r.hl_endpos);
+    *hip = (hi == NULL_POSITION) ? n->r.hl_startpos : MINPOS(hi, n->r.hl_startpos);
+  }
+  return (false);
+}
+
 /*
  * Tree node storage: get the current block of nodes if it has spare
  * capacity, or create a new one if not.
@@ -684,6 +741,11 @@ static void add_hilite(struct hilite_tree* anchor, struct hilite* hl)
   if (hl->hl_startpos >= hl->hl_endpos)
     return;
 
+  if (added_startpos == NULL_POSITION || hl->hl_startpos < added_startpos)
+    added_startpos = hl->hl_startpos;
+  if (added_endpos == NULL_POSITION || hl->hl_endpos > added_endpos)
+    added_endpos = hl->hl_endpos;
+
   p = anchor->root;
 
   /* Inserting the very first node is trivial. */
@@ -1536,6 +1598,29 @@ int is_filtering(void)
     return (0);
   return prev_pattern(&filter_info);
 }
+
+/*
+ * Return a number which changes whenever hilites or filters
+ * are cleared, or hilites are hidden or shown.
+ */
+long hilite_serial(void)
+{
+  return (2 * hilite_clears + (hide_hilite ? 1 : 0));
+}
+
+/*
+ * Get the range of positions in which hilites or filters have been
+ * added since we were last called.  Return false if there are none.
+ */
+bool hilite_added(position_t* spos, position_t* epos)
+{
+  if (added_startpos == NULL_POSITION)
+    return (false);
+  *spos          = added_startpos;
+  *epos          = added_endpos;
+  added_startpos = added_endpos = NULL_POSITION;
+  return (true);
+}
 #endif
 
 #if HAVE_V8_REGCOMP
@@ -20,12 +20,15 @@ int        is_filtered(position_t pos);
 position_t next_unfiltered(position_t pos);
 position_t prev_unfiltered(position_t pos);
 int        is_hilited(position_t pos, position_t epos, int nohide, int* p_matches);
+bool       hilite_run(position_t pos, position_t* lop, position_t* hip);
 void       chg_hilite(void);
 void       chg_caseless(void);
 int        search(int search_type, char* pattern, int n);
 void       prep_hilite(position_t spos, position_t epos, int maxlines);
 void       set_filter_pattern(char* pattern, int search_type);
 int        is_filtering(void);
+long       hilite_serial(void);
+bool       hilite_added(position_t* spos, position_t* epos);
 
 } // namespace search
 
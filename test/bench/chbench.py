@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+#
+# Benchmark for the ch buffer pool.
+#
+# Runs eless on a pseudo-terminal, once per scenario and option set,
+# and reports the elapsed time and the number of read system calls
+# (from /proc/PID/io) needed to get there.  Scenarios:
+#
+#   G       +G        jump to the end of the file
+#   search  +/pat     forward search for a line near the end of the file
+#   count   -N +G     jump to the end with line numbers (counts every line)
+#
+# Usage:
+#   ./chbench.py [-e ../../eless] [-f file] [-s MB] [-r runs] \
+#                [-o="--block-size=8" -o="--block-size=1024" ...]
+#
+# If no file is given, a file of numbered lines is generated (-s MB big).
+# Each -o is one set of eless options to compare; the default compares
+# block sizes of 8K, 64K and 1M against the automatic choice, and 8K
+# blocks with unlimited buffers (so that sequential reads can fill
+# many buffers per system call).  Option sets starting with "-" must
+# be given as -o="...".
+#
+
+import argparse
+import fcntl
+import os
+import pty
+import select
+import signal
+import struct
+import sys
+import tempfile
+import termios
+import time
+
+MARK = b"@@CHBENCH@@"
+
+
+def make_file(mb):
+    f = tempfile.NamedTemporaryFile(prefix="chbench.", suffix=".txt", delete=False)
+    line = 0
+    size = mb * 1024 * 1024
+    written = 0
+    while written < size:
+        chunk = "".join(
+            "%09d the quick brown fox jumps over the lazy dog %d\n" % (line + i, (line + i) * 7919)
+            for i in range(10000))
+        f.write(chunk.encode())
+        written += len(chunk)
+        line += 10000
+    f.close()
+    return f.name, line - 1
+
+
+def read_io(pid):
+    io = {}
+    try:
+        with open("/proc/%d/io" % pid) as f:
+            for l in f:
+                k, v = l.split(":")
+                io[k] = int(v)
+    except OSError:
+        pass
+    return io
+
+
+def run_one(eless, args, timeout):
+    """Run eless until its prompt appears; return (seconds, syscr, rchar)."""
+    pid, fd = pty.fork()
+    if pid == 0:
+        env = dict(os.environ, TERM="xterm", LESS="", LESSHISTFILE="-")
+        os.chdir(tempfile.gettempdir())  # eless may write trace.out in its cwd
+        os.execve(eless, [eless, "-Ps" + MARK.decode()] + args, env)
+    fcntl.ioctl(fd, termios.TIOCSWINSZ, struct.pack("HHHH", 40, 120, 0, 0))
+    start = time.monotonic()
+    seen = b""
+    elapsed = None
+    while time.monotonic() - start < timeout:
+        r, _, _ = select.select([fd], [], [], 0.5)
+        if not r:
+            continue
+        try:
+            data = os.read(fd, 65536)
+        except OSError:
+            break
+        seen = (seen + data)[-4096:]
+        if MARK in seen:
+            elapsed = time.monotonic() - start
+            break
+    io = read_io(pid)
+    if elapsed is None:
+        os.kill(pid, signal.SIGKILL)
+    else:
+        os.write(fd, b"q")
+    os.waitpid(pid, 0)
+    os.close(fd)
+    return elapsed, io.get("syscr"), io.get("rchar")
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Benchmark the eless buffer pool")
+    ap.add_argument("-e", "--eless", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "../../eless"))
+    ap.add_argument("-f", "--file", help="file to view (default: generate one)")
+    ap.add_argument("-p", "--pattern", help="search pattern (default: last line of generated file)")
+    ap.add_argument("-s", "--size", type=int, default=32, help="size of generated file in MB")
+    ap.add_argument("-r", "--runs", type=int, default=3, help="runs per measurement (best is reported)")
+    ap.add_argument("-t", "--timeout", type=float, default=600, help="give up after this many seconds")
+    ap.add_argument("-o", "--opts", action="append", help="option set to compare (repeatable)")
+    ap.add_argument("scenarios", nargs="*", default=["G", "search", "count"])
+    a = ap.parse_args()
+
+    eless = os.path.abspath(a.eless)
+    tmp = None
+    if a.file:
+        path, pattern = os.path.abspath(a.file), a.pattern
+        if pattern is None:
+            sys.exit("chbench: -p is needed with -f")
+    else:
+        path, last = make_file(a.size)
+        tmp = path
+        pattern = a.pattern or "^%09d " % last
+    optsets = a.opts or ["", "--block-size=8", "--block-size=8 -b-1", "--block-size=64", "--block-size=1024"]
+    scen = {
+        "G": ["+G"],
+        "search": ["+/" + pattern],
+        "count": ["-N", "+G"],
+    }
+
+    print("file: %s (%d bytes)" % (path, os.path.getsize(path)))
+    print("%-28s %-8s %10s %10s %12s" % ("options", "scenario", "seconds", "syscr", "rchar"))
+    try:
+        for opts in optsets:
+            for s in a.scenarios:
+                best = None
+                for _ in range(a.runs):
+                    r = run_one(eless, opts.split() + scen[s] + [path], a.timeout)
+                    if r[0] is not None and (best is None or r[0] < best[0]):
+                        best = r
+                if best is None:
+                    print("%-28s %-8s %10s" % (opts or "(default)", s, "timeout"))
+                else:
+                    print("%-28s %-8s %10.3f %10s %12s" % (opts or "(default)", s, best[0], best[1], best[2]))
+                sys.stdout.flush()
+    finally:
+        if tmp:
+            os.unlink(tmp)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1 @@
+../../brac.hpp
\ No newline at end of file
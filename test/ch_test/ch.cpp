@@ -0,0 +1 @@
+../../ch.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../ch.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../charset.hpp
\ No newline at end of file
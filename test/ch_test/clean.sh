@@ -24,6 +24,7 @@ rm -f lglob.hpp > /dev/null
 rm -f line.hpp > /dev/null
 rm -f linenum.hpp > /dev/null
 rm -f lsystem.hpp > /dev/null
+rm -f lz.hpp > /dev/null
 rm -f mark.hpp > /dev/null
 rm -f optfunc.hpp > /dev/null
 rm -f option.hpp > /dev/null
@@ -0,0 +1 @@
+../../cmd.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../cmdbuf.hpp
\ No newline at end of file
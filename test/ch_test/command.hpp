@@ -0,0 +1 @@
+../../command.hpp
\ No newline at end of file
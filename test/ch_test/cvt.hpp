@@ -0,0 +1 @@
+../../cvt.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../debug.hpp
\ No newline at end of file
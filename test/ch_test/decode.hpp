@@ -0,0 +1 @@
+../../decode.hpp
\ No newline at end of file
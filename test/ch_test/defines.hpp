@@ -0,0 +1 @@
+../../defines.hpp
\ No newline at end of file
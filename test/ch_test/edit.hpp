@@ -0,0 +1 @@
+../../edit.hpp
\ No newline at end of file
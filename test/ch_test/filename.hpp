@@ -0,0 +1 @@
+../../filename.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../forwback.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../help.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+ch_mocks.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../input.hpp
\ No newline at end of file
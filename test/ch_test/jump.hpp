@@ -0,0 +1 @@
+../../jump.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../less.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../lesskey.hpp
\ No newline at end of file
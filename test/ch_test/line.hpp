@@ -0,0 +1 @@
+../../line.hpp
\ No newline at end of file
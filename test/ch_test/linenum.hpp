@@ -0,0 +1 @@
+../../linenum.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../lsystem.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../mark.hpp
\ No newline at end of file
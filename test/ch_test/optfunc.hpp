@@ -0,0 +1 @@
+../../optfunc.hpp
\ No newline at end of file
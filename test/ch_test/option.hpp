@@ -0,0 +1 @@
+../../option.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../opttbl.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../os.hpp
\ No newline at end of file
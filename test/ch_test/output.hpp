@@ -0,0 +1 @@
+../../output.hpp
\ No newline at end of file
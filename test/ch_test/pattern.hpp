@@ -0,0 +1 @@
+../../pattern.hpp
\ No newline at end of file
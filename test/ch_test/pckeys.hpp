@@ -0,0 +1 @@
+../../pckeys.hpp
\ No newline at end of file
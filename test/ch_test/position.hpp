@@ -0,0 +1 @@
+../../position.hpp
\ No newline at end of file
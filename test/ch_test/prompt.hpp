@@ -0,0 +1 @@
+../../prompt.hpp
\ No newline at end of file
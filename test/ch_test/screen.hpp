@@ -0,0 +1 @@
+../../screen.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../search.hpp
\ No newline at end of file
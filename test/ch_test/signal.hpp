@@ -0,0 +1 @@
+../../signal.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../tags.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../ttyin.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../utils.hpp
\ No newline at end of file
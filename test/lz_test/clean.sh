@@ -0,0 +1,4 @@
+#!/usr/bin/sh
+# Cleanup links
+rm -f lz.hpp > /dev/null
+rm -f lz.cpp > /dev/null
@@ -0,0 +1,244 @@
+// Round trip tests for the block compressor used for cold pipe blocks.
+// The encoder and decoder are checked against each other, and the
+// decoder is checked against hand made and damaged input.
+
+#include "lz.cpp"
+
+#include "gtest/gtest.h"
+
+#include <random>
+#include <vector>
+
+using namespace ::testing;
+
+namespace {
+
+typedef std::vector<unsigned char> bytes;
+
+// Random bytes, the same on every run
+bytes random_bytes(int n, unsigned int seed)
+{
+    std::mt19937 gen(seed);
+    bytes        b(n);
+    for (auto& c : b)
+        c = static_cast<unsigned char>(gen());
+    return b;
+}
+
+// Compress src, check it fits in lz::bound, and return the result
+bytes compress(const bytes& src)
+{
+    bytes dst(lz::bound(static_cast<int>(src.size())));
+    int   n = lz::compress(src.data(), static_cast<int>(src.size()), dst.data(), static_cast<int>(dst.size()));
+    EXPECT_GT(n, 0);
+    dst.resize(n);
+    return dst;
+}
+
+// Compress and decompress src, and check we get it back
+bytes round_trip(const bytes& src)
+{
+    bytes z = compress(src);
+    bytes out(src.size() + 1);
+    int   n = lz::decompress(z.data(), static_cast<int>(z.size()), out.data(), static_cast<int>(out.size()));
+    EXPECT_EQ(n, static_cast<int>(src.size()));
+    out.resize(n < 0 ? 0 : n);
+    EXPECT_EQ(out, src);
+    return z;
+}
+
+// A block of text with plenty of repeats, like a log
+bytes log_text(int lines)
+{
+    std::string s;
+    for (int i = 0; i < lines; i++)
+        s += "2024-01-01 12:00:" + std::to_string(i % 60) + " INFO request id=" + std::to_string(i * 31) + " status=ok\n";
+    return bytes(s.begin(), s.end());
+}
+
+// --------------------------------------------------------------
+
+TEST(LzTest, EmptyBlock)
+{
+    bytes z = round_trip(bytes());
+    // Just a token with no literals
+    ASSERT_EQ(z.size(), 1u);
+    EXPECT_EQ(z[0], 0);
+}
+
+TEST(LzTest, ShortBlocks)
+{
+    // Too short to hold a match: all literals
+    for (int n = 1; n <= 16; n++)
+        round_trip(bytes(n, 'a'));
+}
+
+TEST(LzTest, Text)
+{
+    bytes src = log_text(2000);
+    bytes z   = round_trip(src);
+    EXPECT_LT(z.size(), src.size() / 3);
+}
+
+TEST(LzTest, Incompressible)
+{
+    for (int n : { 100, 4096, 65536, 200000 }) {
+        bytes src = random_bytes(n, n);
+        bytes z   = round_trip(src);
+        EXPECT_LE(static_cast<int>(z.size()), lz::bound(n));
+    }
+}
+
+TEST(LzTest, LongRuns)
+{
+    // A run is a match which overlaps what it copies (offset 1)
+    bytes src(100000, 'x');
+    bytes z = round_trip(src);
+    EXPECT_LT(z.size(), 1000u);
+
+    // Short periods overlap too
+    bytes pat = { 'a', 'b', 'c' };
+    src.clear();
+    for (int i = 0; i < 30000; i++)
+        src.push_back(pat[i % 3]);
+    round_trip(src);
+
+    // Runs in between literals
+    src = random_bytes(1000, 1);
+    src.insert(src.begin() + 300, 5000, ' ');
+    src.insert(src.begin() + 700, 300, '\0');
+    round_trip(src);
+}
+
+TEST(LzTest, FarMatches)
+{
+    // Matches up to the largest offset, and just past it
+    for (int gap : { 65535 - 64, 65535 - 63, 70000 }) {
+        bytes head = random_bytes(64, 2);
+        bytes src  = head;
+        bytes mid  = random_bytes(gap, 3);
+        src.insert(src.end(), mid.begin(), mid.end());
+        src.insert(src.end(), head.begin(), head.end());
+        round_trip(src);
+    }
+}
+
+// Literal lengths of 15 and 15+255: the length byte after the token
+// is 0 for 15, and 255 then 0 for 270.
+TEST(LzTest, LiteralLengths)
+{
+    for (int nlit : { 14, 15, 16, 269, 270, 271, 15 + 255 + 255 }) {
+        bytes src = random_bytes(nlit, 4);
+        // Repeat the start, so the first sequence has nlit literals
+        src.insert(src.end(), src.begin(), src.begin() + 8);
+        bytes tail = random_bytes(8, 5);
+        src.insert(src.end(), tail.begin(), tail.end());
+
+        bytes z = round_trip(src);
+        if (nlit < 15)
+            EXPECT_EQ(z[0] >> 4, nlit);
+        else {
+            EXPECT_EQ(z[0] >> 4, 15);
+            int n = 15, i = 1;
+            while (z[i] == 255)
+                n += z[i++];
+            n += z[i];
+            EXPECT_EQ(n, nlit);
+        }
+    }
+}
+
+// Match lengths (less MINMATCH) of 15 and 15+255.
+TEST(LzTest, MatchLengths)
+{
+    for (int nmatch : { 14, 15, 16, 269, 270, 271, 15 + 255 + 255 }) {
+        int   period = 8;
+        bytes unit   = random_bytes(period, 6);
+        bytes src    = unit;
+        // A match of period bytes back, MINMATCH + nmatch long
+        for (int i = 0; i < 4 + nmatch; i++)
+            src.push_back(unit[i % period]);
+        // Then something which doesn't continue it
+        bytes tail = random_bytes(8, 7);
+        tail[0]    = static_cast<unsigned char>(unit[(4 + nmatch) % period] ^ 0xff);
+        src.insert(src.end(), tail.begin(), tail.end());
+
+        bytes z = round_trip(src);
+        // Token, the literals, then the offset
+        ASSERT_EQ(z[0] >> 4, period);
+        size_t i = 1 + period;
+        EXPECT_EQ(z[i] | (z[i + 1] << 8), period);
+        i += 2;
+        if (nmatch < 15)
+            EXPECT_EQ(z[0] & 15, nmatch);
+        else {
+            EXPECT_EQ(z[0] & 15, 15);
+            int n = 15;
+            while (z[i] == 255)
+                n += z[i++];
+            n += z[i];
+            EXPECT_EQ(n, nmatch);
+        }
+    }
+}
+
+TEST(LzTest, CompressNoRoom)
+{
+    bytes src = random_bytes(1000, 8);
+    bytes dst(500);
+    EXPECT_EQ(lz::compress(src.data(), 1000, dst.data(), 500), 0);
+}
+
+TEST(LzTest, DecompressNoRoom)
+{
+    bytes src = log_text(100);
+    bytes z   = compress(src);
+    bytes out(src.size() - 1);
+    EXPECT_EQ(lz::decompress(z.data(), static_cast<int>(z.size()), out.data(), static_cast<int>(out.size())), -1);
+}
+
+TEST(LzTest, Truncated)
+{
+    bytes src = log_text(100);
+    bytes z   = compress(src);
+    bytes out(src.size());
+    // The last sequence always has literals, so losing any of them shows
+    for (int cut = 1; cut <= 5; cut++)
+        EXPECT_EQ(lz::decompress(z.data(), static_cast<int>(z.size()) - cut, out.data(), static_cast<int>(out.size())), -1);
+}
+
+TEST(LzTest, Corrupt)
+{
+    unsigned char out[100];
+    const struct {
+        bytes       z;
+        const char* what;
+    } bad[] = {
+        { { 0x20, 'a' }, "literals run past the input" },
+        { { 0xf0 }, "literal length runs past the input" },
+        { { 0xf0, 255 }, "literal length continues past the input" },
+        { { 0x10, 'a', 0x01 }, "half an offset" },
+        { { 0x10, 'a', 0x00, 0x00 }, "zero offset" },
+        { { 0x10, 'a', 0x02, 0x00 }, "offset before the start" },
+        { { 0x1f, 'a', 0x01, 0x00 }, "match length runs past the input" },
+        { { 0x1f, 'a', 0x01, 0x00, 200 }, "match runs past the output" },
+    };
+    for (const auto& b : bad)
+        EXPECT_EQ(lz::decompress(b.z.data(), static_cast<int>(b.z.size()), out, sizeof(out)), -1) << b.what;
+
+    // And a good one, to show the bad ones are bad for the reason given
+    bytes good = { 0x10, 'a', 0x01, 0x00, 0x00 };
+    EXPECT_EQ(lz::decompress(good.data(), static_cast<int>(good.size()), out, sizeof(out)), 5);
+}
+
+} // namespace
+
+// Google Test can be run manually from the main() function
+// or, it can be linked to the gtest_main library for an already
+// set-up main() function primed to accept Google Test test cases.
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,4 @@
+#!/usr/bin/sh
+
+ln -sf ../../lz.hpp .
+ln -sf ../../lz.cpp